@@ -0,0 +1,92 @@
+/* 
+ * Arena
+ * Bump allocator for the data that lives as long as a book
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "Arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+Arena::Block * Arena::newBlock(size_t size) {
+    Block * b = (Block *)malloc(kHeaderLen + size);
+    if(!b) return NULL;
+    b->size = size;
+    return b;
+}
+
+void * Arena::alloc(size_t size) {
+    size = ALIGN(size ? size : 1);
+    if(size <= (size_t)(end - pos)) {
+	void * p = pos;
+	pos += size;
+	return p;
+    }
+    // a big allocation gets its own block, behind the current one
+    if(size > blockSize / 4) {
+	Block * b = newBlock(size);
+	if(!b) return NULL;
+	if(head) {
+	    b->next = head->next;
+	    head->next = b;
+	} else {
+	    b->next = NULL;
+	    head = b;
+	}
+	return (char *)b + kHeaderLen;
+    }
+    Block * b = newBlock(blockSize);
+    if(!b) return NULL;
+    b->next = head;
+    head = b;
+    pos = (char *)b + kHeaderLen;
+    end = pos + blockSize;
+    void * p = pos;
+    pos += size;
+    return p;
+}
+
+void * Arena::calloc(size_t count, size_t size) {
+    if(size && count > (size_t)-1 / size) return NULL;
+    void * p = alloc(count * size);
+    if(p) memset(p, 0, count * size);
+    return p;
+}
+
+void * Arena::dup(const void * data, size_t len) {
+    void * p = alloc(len);
+    if(p) memcpy(p, data, len);
+    return p;
+}
+
+char * Arena::strdup(const char * s) {
+    return (char *)dup(s, strlen(s) + 1);
+}
+
+void Arena::reset() {
+    Block * keep = NULL;
+    while(head) {
+	Block * next = head->next;
+	if(!keep && head->size == blockSize) keep = head;
+	else free(head);
+	head = next;
+    }
+    head = keep;
+    if(keep) {
+	keep->next = NULL;
+	pos = (char *)keep + kHeaderLen;
+	end = pos + blockSize;
+    } else pos = end = NULL;
+}
+
+Arena::~Arena() {
+    while(head) {
+	Block * next = head->next;
+	free(head);
+	head = next;
+    }
+}
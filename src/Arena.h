@@ -0,0 +1,55 @@
+/* 
+ * Arena
+ * Bump allocator for the data that lives as long as a book
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef ARENA_H
+#define	ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK	(256*1024)
+#define ARENA_ALIGN	16
+
+/*
+ * Allocations are carved from large blocks (bigger ones get a block
+ * of their own) and are all released together, by reset() or by the
+ * destructor. Not synchronized: books allocate while opening.
+ */
+class Arena {
+public:
+    Arena(size_t blockSize = ARENA_BLOCK) : head(NULL), pos(NULL), end(NULL), blockSize(blockSize) {}
+    ~Arena();
+
+    // NULL if out of memory
+    void *	alloc(size_t size);
+    // zeroed array of count elements of size bytes
+    void *	calloc(size_t count, size_t size);
+    void *	dup(const void * data, size_t len);
+    char *	strdup(const char * s);
+
+    // release everything, keeping one block for the next book
+    void	reset();
+
+private:
+    struct Block {
+	Block *	next;
+	size_t	size;
+    };
+    // the data of a block follows its header
+    static const size_t kHeaderLen = (sizeof(Block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    Block *	newBlock(size_t size);
+
+    Block *	head;
+    char *	pos, * end;
+    size_t	blockSize;
+
+    Arena(const Arena &);
+    Arena & operator=(const Arena &);
+};
+
+#endif	/* ARENA_H */
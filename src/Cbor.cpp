@@ -0,0 +1,220 @@
+/* 
+ * Cbor
+ * Compact binary metadata (RFC 8949)
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "Cbor.h"
+
+#define MAJ_UINT	0
+#define MAJ_NINT	1
+#define MAJ_BYTES	2
+#define MAJ_TEXT	3
+#define MAJ_ARRAY	4
+#define MAJ_MAP		5
+#define MAJ_TAG		6
+#define MAJ_SIMPLE	7
+
+#define INDEFINITE	31
+#define TAG_CBOR	24
+#define BREAK		0xff
+
+// length returned by readHead for indefinite items
+#define NOLEN		((uint64_t)-1)
+
+CborWriter::~CborWriter() {
+    flush();
+}
+
+void CborWriter::head(int major, uint64_t n, string & out) {
+    char h[9];
+    int len;
+
+    if(n < 24) {
+	h[0] = major << 5 | n;
+	len = 1;
+    } else {
+	int size = n <= 0xff ? 1 : n <= 0xffff ? 2 : n <= 0xffffffffULL ? 4 : 8;
+	h[0] = major << 5 | (size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27);
+	for(int i = size; i > 0; --i, n >>= 8) h[i] = n & 0xff;
+	len = size + 1;
+    }
+    out.append(h, len);
+}
+
+void CborWriter::begin() {
+    ++depth;
+}
+
+// closes the record when back at the top level
+void CborWriter::end() {
+    if(--depth > 0) return;
+    depth = 0;	// a bare top level value
+    head(MAJ_TAG, TAG_CBOR, buf);
+    head(MAJ_BYTES, rec.size(), buf);
+    buf.append(rec);
+    rec.clear();
+    check();
+}
+
+MetaWriter& CborWriter::beginObject() {
+    rec.push_back(MAJ_MAP << 5 | INDEFINITE);
+    begin();
+    return *this;
+}
+
+MetaWriter& CborWriter::endObject() {
+    rec.push_back((char)BREAK);
+    end();
+    return *this;
+}
+
+MetaWriter& CborWriter::beginArray() {
+    rec.push_back(MAJ_ARRAY << 5 | INDEFINITE);
+    begin();
+    return *this;
+}
+
+MetaWriter& CborWriter::endArray() {
+    rec.push_back((char)BREAK);
+    end();
+    return *this;
+}
+
+MetaWriter& CborWriter::key(const string & k) {
+    head(MAJ_TEXT, k.size(), rec);
+    rec.append(k);
+    return *this;
+}
+
+MetaWriter& CborWriter::value(const char * v, size_t len) {
+    head(MAJ_TEXT, len, rec);
+    rec.append(v, len);
+    if(!depth) end();
+    return *this;
+}
+
+MetaWriter& CborWriter::value(long v) {
+    if(v >= 0) head(MAJ_UINT, v, rec);
+    else head(MAJ_NINT, -1 - v, rec);
+    if(!depth) end();
+    return *this;
+}
+
+CborReader::CborReader(const char * data, size_t len) {
+    p = (const uint8_t *)data;
+    end = p + len;
+    depth = 0;
+}
+
+bool CborReader::readHead(int & major, uint64_t & n) {
+    if(p >= end) return false;
+    major = *p >> 5;
+    int info = *p++ & 0x1f;
+
+    if(info < 24) {
+	n = info;
+	return true;
+    }
+    if(info == INDEFINITE) {
+	n = NOLEN;
+	return true;
+    }
+    if(info > 27) return false;
+    int size = 1 << (info - 24);
+    if(end - p < size) return false;
+    for(n = 0; size > 0; --size) n = n << 8 | *p++;
+    return true;
+}
+
+bool CborReader::nextRecord(CborReader & rec) {
+    const uint8_t * start = p;
+    int major;
+    uint64_t n;
+
+    if(readHead(major, n) && major == MAJ_TAG && n == TAG_CBOR
+	    && readHead(major, n) && major == MAJ_BYTES
+	    && n <= (uint64_t)(end - p)) {
+	rec.p = p;
+	rec.end = p + n;
+	rec.depth = 0;
+	p += n;
+	return true;
+    }
+    p = start;
+    return false;
+}
+
+CborReader::Type CborReader::peek() {
+    if(p >= end) return Invalid;
+    if(*p == BREAK) return Break;
+    switch(*p >> 5) {
+	case MAJ_UINT: case MAJ_NINT: return Int;
+	case MAJ_TEXT: return String;
+	case MAJ_ARRAY: return Array;
+	case MAJ_MAP: return Map;
+    }
+    return Invalid;
+}
+
+bool CborReader::readInt(long & v) {
+    int major;
+    uint64_t n;
+    if(peek() != Int || !readHead(major, n)) return false;
+    v = major == MAJ_UINT ? (long)n : -1 - (long)n;
+    return true;
+}
+
+bool CborReader::readString(const char *& s, size_t & len) {
+    int major;
+    uint64_t n;
+    const uint8_t * start = p;
+    if(peek() != String || !readHead(major, n)
+	    || n > (uint64_t)(end - p)) {
+	p = start;
+	return false;
+    }
+    s = (const char *)p;
+    len = n;
+    p += n;
+    return true;
+}
+
+bool CborReader::enter() {
+    Type t = peek();
+    if(t != Array && t != Map) return false;
+    if(depth >= CBOR_MAX_DEPTH) return false;
+    ++depth;
+    ++p;
+    return true;
+}
+
+bool CborReader::atEnd() {
+    return p >= end || *p == BREAK;
+}
+
+bool CborReader::leave() {
+    if(p >= end || *p != BREAK) return false;
+    --depth;
+    ++p;
+    return true;
+}
+
+bool CborReader::skip() {
+    const char * s;
+    size_t len;
+    long v;
+
+    switch(peek()) {
+	case Int: return readInt(v);
+	case String: return readString(s, len);
+	case Array: case Map:
+	    if(!enter()) return false;
+	    while(!atEnd())
+		if(!skip()) return false;
+	    return leave();
+	default: return false;
+    }
+}
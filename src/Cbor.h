@@ -0,0 +1,82 @@
+/* 
+ * Cbor
+ * Compact binary metadata (RFC 8949)
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef CBOR_H
+#define	CBOR_H
+
+#include "MetaWriter.h"
+#include <stdint.h>
+
+// nesting limit for the reader, so that crafted data can't
+// exhaust the stack of recursive readers
+#define CBOR_MAX_DEPTH	64
+
+/*
+ * Every top level item is written as a record: tag 24 (encoded
+ * cbor item) on a byte string, so its length comes first and
+ * records can be concatenated or skipped without decoding them.
+ * Objects and arrays use indefinite length, strings are definite.
+ */
+class CborWriter : public MetaWriter {
+public:
+    CborWriter(int fd = -1) : MetaWriter(fd), depth(0) {}
+    virtual ~CborWriter();
+
+    using MetaWriter::value;
+    MetaWriter& beginObject();
+    MetaWriter& endObject();
+    MetaWriter& beginArray();
+    MetaWriter& endArray();
+    MetaWriter& key(const string & k);
+    MetaWriter& value(const char * v, size_t len);
+    MetaWriter& value(long v);
+    MetaWriter& endRecord() { return *this; }
+
+    const char * extension() { return ".cbor"; }
+
+private:
+    void head(int major, uint64_t n, string & out);
+    void begin();
+    void end();
+
+    string rec;	// the record being built
+    int depth;
+};
+
+/*
+ * Reads what CborWriter writes. Strings are returned as pointers
+ * into the data, nothing is copied.
+ */
+class CborReader {
+public:
+    enum Type { Int, String, Array, Map, Break, Invalid };
+
+    CborReader(const char * data, size_t len);
+
+    /* Next record of a sequence, false at the end of the data */
+    bool nextRecord(CborReader & rec);
+
+    Type peek();
+    bool readInt(long & v);
+    bool readString(const char *& s, size_t & len);
+    /* Step into an array or map; atEnd() is true on its break.
+     * False past CBOR_MAX_DEPTH levels */
+    bool enter();
+    bool atEnd();
+    bool leave();
+    /* Skip the next item, containers included */
+    bool skip();
+
+private:
+    bool readHead(int & major, uint64_t & n);
+
+    const uint8_t * p, * end;
+    int depth;
+};
+
+#endif	/* CBOR_H */
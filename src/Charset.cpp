@@ -0,0 +1,116 @@
+/* 
+ * Charset
+ * Conversion of legacy 8 bit text to UTF-8
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "Charset.h"
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using std::string;
+
+// windows-1252 0x80..0x9f; the unassigned ones
+// are kept as the C1 controls, as latin-1 does
+static const uint16_t cp1252High[32] = {
+    0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+    0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+    0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+    0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178
+};
+
+// UTF-8 sequences of the bytes 0x80..0xff
+struct Utf8Table {
+    uint8_t	len[128];
+    char	seq[128][3];
+
+    Utf8Table(const uint16_t * high) {
+	for(int i = 0; i < 128; ++i) {
+	    uint16_t c = (high && i < 32) ? high[i] : 0x80 + i;
+	    if(c < 0x800) {
+		len[i] = 2;
+		seq[i][0] = 0xc0 | c >> 6;
+		seq[i][1] = 0x80 | (c & 0x3f);
+	    } else {
+		len[i] = 3;
+		seq[i][0] = 0xe0 | c >> 12;
+		seq[i][1] = 0x80 | (c >> 6 & 0x3f);
+		seq[i][2] = 0x80 | (c & 0x3f);
+	    }
+	}
+    }
+};
+
+static const Utf8Table & table(int cp) {
+    static const Utf8Table cp1252(cp1252High), latin1(NULL);
+    return cp == CP_1252 ? cp1252 : latin1;
+}
+
+// length of the run of ascii characters at s, up to max
+static inline size_t asciiRun(const char * s, size_t max) {
+    size_t i = 0;
+#ifdef __SSE2__
+    while(max - i >= 16) {
+	int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+	if(mask) return i + __builtin_ctz(mask);
+	i += 16;
+    }
+#endif
+    while(i < max && !(s[i] & 0x80)) ++i;
+    return i;
+}
+
+bool isLegacyCodePage(int cp) {
+    return cp == CP_1252 || cp == CP_LATIN1;
+}
+
+void appendUtf8(int cp, const char * s, size_t len, string & out) {
+    const Utf8Table & t = table(cp);
+    size_t i, size = len;
+
+    // size first, so out is resized once
+    for(i = asciiRun(s, len); i < len; i += 1 + asciiRun(s + i + 1, len - i - 1))
+	size += t.len[(uint8_t)s[i] - 0x80] - 1;
+
+    size_t at = out.size();
+    out.resize(at + size);
+    char * d = &out[at];
+    for(i = 0; i < len; ) {
+	size_t run = asciiRun(s + i, len - i);
+	memcpy(d, s + i, run);
+	d += run;
+	i += run;
+	if(i == len) break;
+	int c = (uint8_t)s[i++] - 0x80;
+	memcpy(d, t.seq[c], t.len[c]);
+	d += t.len[c];
+    }
+}
+
+string toUtf8(int cp, const string & s) {
+    string res;
+    appendUtf8(cp, s.data(), s.size(), res);
+    return res;
+}
+
+size_t utf8Skip(const char * s, size_t len, size_t chars) {
+    size_t i = 0;
+    while(chars > 0 && i < len) {
+	// ascii: one byte per character
+	size_t run = asciiRun(s + i, std::min(len - i, chars));
+	i += run;
+	chars -= run;
+	if(!chars || i == len) break;
+	// a multibyte character
+	++i;
+	while(i < len && ((uint8_t)s[i] & 0xc0) == 0x80) ++i;
+	--chars;
+    }
+    return i;
+}
@@ -0,0 +1,30 @@
+/* 
+ * Charset
+ * Conversion of legacy 8 bit text to UTF-8
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef CHARSET_H
+#define	CHARSET_H
+
+#include <string>
+#include <stddef.h>
+
+// code pages (CP_UTF8 is in Utils.h)
+#define CP_1252		1252
+#define CP_LATIN1	28591
+
+// code pages that appendUtf8 converts
+bool isLegacyCodePage(int cp);
+
+// Append len bytes of text in code page cp to out, converted to UTF-8.
+// out grows exactly by the converted size
+void appendUtf8(int cp, const char * s, size_t len, std::string & out);
+std::string toUtf8(int cp, const std::string & s);
+
+// Bytes taken by the first chars characters of UTF-8 text s
+size_t utf8Skip(const char * s, size_t len, size_t chars);
+
+#endif	/* CHARSET_H */
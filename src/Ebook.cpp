@@ -8,49 +8,119 @@
 
 #include "Ebook.h"
 #include "Utils.h"
+#include "ThreadPool.h"
+#include "Output.h"
+#include "MetaWriter.h"
 #include <stdio.h>
 #include <libgen.h>
+#include <memory>
 
 using std::string;
 
+Dumper::Dumper(Ebook * sb, const char * op) : outDir(op), book(sb), threads(1),
+	format(META_JSON), infoOnly(false), pool(NULL), output(new DirOutput(op)) {
+}
+
+bool Dumper::dump() {
+    produce();
+    // pending writes may still be running, metadata
+    // doesn't depend on them
+    dumpMetadata();
+    return out()->finish();
+}
+
+void Dumper::info(MetaWriter & meta) {
+    infoOnly = true;
+    setOutput(new NullOutput());
+    produce();
+    writeInfo(meta);
+}
+
+void Dumper::dumpMetadata() {
+    std::unique_ptr<MetaWriter> meta(metaWriter());
+    meta->beginObject();
+    writeInfo(*meta);
+    meta->endObject();
+    writeMeta(*meta);
+}
+
+void Dumper::produce() {
+    if(threads > 1) pool = new ThreadPool(threads);
+
+    dumpText();
+    dumpResources();
+
+    if(pool) {
+	pool->wait();
+	delete pool;
+	pool = NULL;
+    }
+}
+
+void Dumper::flush() {
+    output->flush();
+}
+
+void Dumper::setOutput(Output * o) {
+    delete output;
+    output = o;
+}
+
+Dumper::~Dumper() {
+    delete output;
+}
+
+void Dumper::submit(std::function<void()> job) {
+    if(pool) pool->submit(job);
+    else job();
+}
+
+MetaWriter * Dumper::metaWriter() {
+    return MetaWriter::create(format);
+}
+
+void Dumper::writeMeta(MetaWriter & meta) {
+    write((string("info") + meta.extension()).c_str(), std::move(meta.str()));
+}
+
+const string * Dumper::original(const string & name, int pos, uint64_t hash,
+	uint64_t size, std::function<bool(int)> same) {
+    std::pair<uint64_t, uint64_t> sum(hash, size);
+    std::pair<Blobs::iterator, Blobs::iterator> range = blobs.equal_range(sum);
+    // a matching hash is just a candidate
+    for(Blobs::iterator it = range.first; it != range.second; ++it) {
+	if(same(it->second.first)) {
+	    dups[name] = it->second.second;
+	    return &it->second.second;
+	}
+    }
+    blobs.insert(std::make_pair(sum, std::make_pair(pos, name)));
+    return NULL;
+}
+
+bool Dumper::link(const char * name, const string & target) {
+    char dname[PATHLEN], tname[PATHLEN];
+
+    strcpy(dname, name);
+    strcpy(tname, target.c_str());
+    return out()->link(basename(dname), basename(tname));
+}
+
+const string * Dumper::sameAs(const string & name) const {
+    std::map<string, string>::const_iterator it = dups.find(name);
+    return it == dups.end() ? NULL : &it->second;
+}
+
 void Dumper::write(const char * name, string content) {
-    FILE * f;
-    char fname[PATHLEN], dname[PATHLEN];
+    char dname[PATHLEN];
     
     strcpy(dname, name);
-    sprintf(fname, "%s%s%s", outDir, SEP, basename(dname));
-    
-    f = fopen(fname, "wb");
-    fprintf(f,"%s", content.c_str());
-    fclose(f);
+    out()->write(basename(dname), std::move(content));
 }
 
-void Dumper::write(const char * name, char * content, size_t len) {
-    FILE * f;
-    char fname[PATHLEN], dname[PATHLEN];
+void Dumper::write(const char * name, const char * content, size_t len) {
+    char dname[PATHLEN];
     
     strcpy(dname, name);
-    sprintf(fname, "%s%s%s", outDir, SEP, basename(dname));
-    
-    f = fopen(fname, "wb");
-    fwrite(content, 1, len, f);
-    fclose(f);
-}
-#define BUFLEN 4096
-string Dumper::read(string name) {
-    FILE * f;
-    string res;
-    char buf[BUFLEN], fname[PATHLEN];
-    size_t read;
-    
-    sprintf(fname, "%s%s%s", outDir, SEP, name.c_str());
-    f = fopen(fname, "rb");
-    read = fread(buf, 1, BUFLEN, f);
-    while(read > 0) {
-	res.append(buf, read);
-	read = fread(buf, 1, BUFLEN, f);
-    }
-    
-    fclose(f);
-    return res;
-}
\ No newline at end of file
+    out()->write(basename(dname), content, len);
+}
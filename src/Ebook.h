@@ -11,23 +11,31 @@
 
 #include <string>
 #include <map>
+#include <stdint.h>
+#include <functional>
+#include "MetaWriter.h"
+#include "Arena.h"
 
 // forward decl
 class Dumper;
+class ThreadPool;
+class Output;
 
 class Ebook {
 public:
 
     virtual ~Ebook() {};
-    virtual std::string	getTitle() { return title; }
-    virtual std::string	getAuthor() { return author; }
-    virtual std::string	getPublisher() { return publisher; }
+    virtual const std::string &	getTitle() const { return title; }
+    virtual const std::string &	getAuthor() const { return author; }
+    virtual const std::string &	getPublisher() const { return publisher; }
     virtual Dumper *	getDumper(const char * outdir) = 0;
 
 protected:
     char *	fileName;
     FILE *	fileHandle;
     std::string	title, author, publisher;
+    // the book's own data, released with it
+    Arena	arena;
     Ebook() : fileName(NULL), fileHandle(0) {};
 
 private:
@@ -35,31 +43,75 @@ private:
 
 class Dumper {
 public:
-    Dumper(Ebook * sb, const char * op) : book(sb), outDir(op) {};
-
-    //Dump everything in outdir
-    void dump() {
-	dumpText();
-	dumpResources();
-	dumpMetadata();
-    }
+    Dumper(Ebook * sb, const char * op);
+
+    //Dump everything in outdir, false if the output couldn't be completed
+    bool dump();
+
+    //Add the fields of info.json to the current object of meta,
+    //without writing any file (the book must be fully opened)
+    void info(MetaWriter & meta);
+
+    //Produce and write text parts and resources with n threads
+    //(metadata is written last, once they are all done)
+    void setThreads(int n) { threads = n; }
+
+    //Backend for the written files (the dumper takes ownership),
+    //files are written synchronously in outdir by default.
+    //Not to be changed while dumping
+    void setOutput(Output * out);
+
+    //Metadata encoding, META_JSON (info.json) or META_CBOR (info.cbor)
+    void setFormat(int f) { format = f; }
     
     virtual void dumpResources() = 0;
     virtual void dumpText() = 0;
-    virtual void dumpMetadata() = 0;
+    virtual void dumpMetadata();
 
     
-    virtual ~Dumper() {};
+    virtual ~Dumper();
 
 protected:
     void	write(const char * name, std::string content);
-    void	write(const char * name, char* content, size_t len);
-    std::string	read(std::string name);
+    //content isn't copied, and must stay valid until the dump is over
+    void	write(const char * name, const char* content, size_t len);
+    //the metadata fields, for dumpMetadata() and info()
+    virtual void writeInfo(MetaWriter & meta) = 0;
+    //complete the pending writes
+    void	flush();
+    //run job on the worker pool, or right away in serial mode
+    void	submit(std::function<void()> job);
+    //a metadata encoder for the chosen format, and its output
+    MetaWriter *	metaWriter();
+    void	writeMeta(MetaWriter & meta);
+    //identical resources are written once: returns the first resource
+    //seen with the same content hash and size for which same(its pos)
+    //confirms the content, or NULL for a new one
+    //(called in order from dumpResources, not from the workers)
+    const std::string *	original(const std::string & name, int pos, uint64_t hash,
+	    uint64_t size, std::function<bool(int)> same);
+    //write name as a link to target, false if the output can't
+    bool	link(const char * name, const std::string & target);
+    //the earlier resource with the same content, NULL if none
+    const std::string *	sameAs(const std::string & name) const;
 
     const char *	outDir;
     Ebook *		book;
+    int			threads;
+    int			format;
+    //info() only: the content isn't written, read it only if needed
+    bool		infoOnly;
+    ThreadPool *	pool;
+    Output *		output;
+    //content (hash, size) -> resources (pos, name), duplicate -> first resource
+    typedef std::multimap<std::pair<uint64_t, uint64_t>, std::pair<int, std::string> > Blobs;
+    Blobs		blobs;
+    std::map<std::string, std::string>	dups;
 
 private:
+    //created with the dumper: the workers only read it
+    Output *	out() { return output; }
+    void	produce();
 };
 
 #endif	/* EBOOK_H */
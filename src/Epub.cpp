@@ -7,22 +7,33 @@
  */
 
 #include "Epub.h"
-#include "JsonObj.h"
 #include "Xml.h"
 #include "Utils.h"
 #include <algorithm>
+#include <string.h>
+#include <memory>
 #include <iostream>
+#include <unordered_map>
+#include <unordered_set>
 
 const string Epub::dcns = "http://purl.org/dc/elements/1.1/";
 const string Epub::dcpref = "dc";
 const string Epub::opfns = "http://www.idpf.org/2007/opf";
 const string Epub::opfpref = "opf";
 
-Epub *	Epub::createFromFile(const char *fileName) {
+// attribute of a manifest item ("" if missing)
+static string attribute(const XmlElement & item, const char * name) {
+    std::map<string, string>::const_iterator it = item.attributes.find(name);
+    return it == item.attributes.end() ? "" : it->second;
+}
+
+static string href(const XmlElement & item) {
+    return attribute(item, "href");
+}
+
+Epub *	Epub::createFromFile(const char *fileName, int mode) {
     Epub * book = new Epub();
-    book->zf = new Zip(fileName);
-    
-    if(!book->check()) {
+    if(!book->reopen(fileName, mode)) {
         delete book;
         return NULL;
     }
@@ -30,18 +41,34 @@ Epub *	Epub::createFromFile(const char *fileName) {
     return book;
 }
 
+bool Epub::reopen(const char *fileName, int mode) {
+    title.clear();
+    author.clear();
+    publisher.clear();
+    items.clear();
+    resources.clear();
+    resourceTypes.clear();
+    base.clear();
+    coverIndex = -1;
+
+    if(zf) zf->open(fileName);
+    else zf = new Zip(fileName);
+    if(mode == EPUB_FULL ? check() : readMetadata(mode == EPUB_COVER))
+	return true;
+    items.clear();
+    resources.clear();
+    resourceTypes.clear();
+    coverIndex = -1;
+    return false;
+}
+
 bool Epub::check() {
     //this checks both archive validity and mimetype presence
     if(!zf->hasFile("mimetype")) return false;
     if(!zf->hasFile("META-INF/container.xml")) return false;
     
-    // read opf path from container
-    string container = zf->getFile("META-INF/container.xml");
-    Xml cx(container);
-    Xpath cp = cx.xpath();
-    vector<string> xr = cp.query("//rootfile/@full-path");
-    if(xr.size() == 0 )  return false;
-    string opfpath = xr[0];
+    string opfpath = opfPath();
+    if(opfpath.empty()) return false;
     base = opfpath.substr(0, opfpath.find_last_of('/')+1);
 
     // parse opf
@@ -50,40 +77,54 @@ bool Epub::check() {
     string opfxml = zf->getFile(opfpath);
     (*ns)[dcpref] = dcns;
     (*ns)[opfpref] = opfns;
-    string mydc = (opfxml.find("<title")==string::npos ? "//dc:" : "//");
-    string myopf = (opfxml.find("<item")==string::npos ? "//opf:" : "//");
 
     Xml opf(opfxml);
     Xpath ox = opf.xpath(ns);
+    // unprefixed elements are in the default namespace, if any
+    string plain = "//" + opf.defaultPrefix();
+    string mydc = (opfxml.find("<title")==string::npos ? "//dc:" : plain);
+    string myopf = (opfxml.find("<item")==string::npos ? "//opf:" : plain);
     title = ox.get(mydc+"title");
     author = ox.get(mydc+"creator");
     publisher = ox.get(mydc+"publisher");
+    // Manifest:
+    // read every <item> once and index it by id
+    vector<XmlElement> manifest = ox.elements(myopf+"item");
+    std::unordered_map<string, const XmlElement *> byId;
+    byId.reserve(manifest.size());
+    for(vector<XmlElement>::iterator it = manifest.begin(); it != manifest.end(); ++it) {
+	std::map<string, string>::iterator id = it->attributes.find("id");
+	// items without href are skipped, the first one wins for an id
+	if(id != it->attributes.end() && !href(*it).empty()) byId.emplace(id->second, &(*it));
+    }
+
     // cover info
-    string coverId = ox.get("//meta[@name='cover']/@content");
-    string coverHref = ox.get(myopf+"item[@id='"+coverId+"']/@href");
+    string coverId = ox.get(myopf+"meta[@name='cover']/@content");
+    string coverHref;
+    std::unordered_map<string, const XmlElement *>::iterator mi = byId.find(coverId);
+    if(mi != byId.end()) coverHref = href(*mi->second);
 
     // Items:
-    // get //itemref/@idref and read the item's href
-    xr = ox.query(myopf+"itemref/@idref");
-    string ix;
-    vector<string> nestx;
+    // get //itemref/@idref and resolve the item's href from the manifest
+    vector<string> xr = ox.query(myopf+"itemref/@idref");
+    std::unordered_set<string> inSpine;
+    items.reserve(xr.size());
     for(vector<string>::iterator it = xr.begin(); it != xr.end(); ++it) {
-	ix = myopf+"item[@id='";
-	ix.append(*it);
-	ix.append("']/@href");
-	nestx = ox.query(ix);
-	if(nestx.size()>0) {
-	    items.push_back(nestx[0]);
+	mi = byId.find(*it);
+	if(mi != byId.end()) {
+	    items.push_back(href(*mi->second));
+	    inSpine.insert(items.back());
 	}
     }
 
     // Resources:
     // <item> not in items vector
-    xr = ox.query(myopf+"item/@href");
-    for(vector<string>::iterator it = xr.begin(); it != xr.end(); ++it) {
-	if(std::find(items.begin(), items.end(), *it) == items.end()) {
-		if(coverHref.compare(*it) == 0) coverIndex = resources.size();
-		resources.push_back(*it);
+    for(vector<XmlElement>::iterator it = manifest.begin(); it != manifest.end(); ++it) {
+	string h = href(*it);
+	if(!h.empty() && inSpine.find(h) == inSpine.end()) {
+		if(coverHref.compare(h) == 0) coverIndex = resources.size();
+		resources.push_back(h);
+		resourceTypes.push_back(attribute(*it, "media-type"));
 	}
     }
     delete ns;
@@ -91,6 +132,164 @@ bool Epub::check() {
     return true;
 }
 
+// read opf path from container
+string Epub::opfPath() {
+    void * cf = zf->openFile("META-INF/container.xml");
+    if(!cf) return "";
+    XmlReader cr(Zip::read, Zip::close, cf);
+    while(cr.next()) {
+	if(cr.isElement() && cr.name() == "rootfile")
+	    return cr.attribute("full-path");
+    }
+    return "";
+}
+
+// a word of a space separated list (as in properties="...")
+static bool hasWord(const string & list, const char * word) {
+    size_t len = strlen(word);
+    for(size_t p = list.find(word); p != string::npos; p = list.find(word, p + 1)) {
+	if((p == 0 || list[p-1] == ' ') && (p + len == list.size() || list[p+len] == ' '))
+	    return true;
+    }
+    return false;
+}
+
+// path of a link in file from, both relative to the opf
+static string resolve(const string & from, const string & rel) {
+    string path = from.substr(0, from.find_last_of('/')+1) + rel.substr(0, rel.find('#'));
+    // drop each ../ with the directory before it
+    size_t p, q;
+    while((p = path.find("/../")) != string::npos) {
+	q = p ? path.rfind('/', p-1) : string::npos;
+	q = (q == string::npos) ? 0 : q+1;
+	path.erase(q, p+4-q);
+    }
+    return path;
+}
+
+// the first image of a cover page ("" if none)
+string Epub::pageImage(const string & page) {
+    void * pf = zf->openFile(base+page);
+    if(!pf) return "";
+    XmlReader pr(Zip::read, Zip::close, pf);
+    string src;
+    while(pr.next()) {
+	if(!pr.isElement()) continue;
+	if(pr.name() == "img") src = pr.attribute("src");
+	else if(pr.name() == "image") src = pr.attribute("xlink:href");
+	if(!src.empty()) return resolve(page, src);
+    }
+    return "";
+}
+
+// Stream the opf up to the end of <metadata>, stopping
+// as soon as title, author and publisher are known.
+// For the cover, go on up to its manifest item (by the
+// cover meta, or the epub3 cover-image property), or
+// else to the cover reference of the guide: an image,
+// or a page showing it
+bool Epub::readMetadata(bool cover) {
+    if(!zf->hasFile("mimetype")) return false;
+    if(!zf->hasFile("META-INF/container.xml")) return false;
+
+    string opfpath = opfPath();
+    if(opfpath.empty()) return false;
+    base = opfpath.substr(0, opfpath.find_last_of('/')+1);
+
+    void * of = zf->openFile(opfpath);
+    if(!of) return false;
+    XmlReader opf(Zip::read, Zip::close, of);
+    string name, coverId, guideHref;
+    // media type of the manifest items, for the guide reference
+    std::unordered_map<string, string> types;
+    bool inManifest = false;
+    while(opf.next()) {
+	name = opf.name();
+	if(opf.isEndElement() && name == (cover ? "guide" : "metadata")) break;
+	if(opf.isEndElement() && name == "manifest") inManifest = false;
+	if(!opf.isElement()) continue;
+
+	if(inManifest) {
+	    if(name == "item" && ((!coverId.empty() && opf.attribute("id") == coverId)
+		    || hasWord(opf.attribute("properties"), "cover-image"))) {
+		coverIndex = 0;
+		resources.push_back(opf.attribute("href"));
+		resourceTypes.push_back(opf.attribute("media-type"));
+		break;
+	    }
+	    if(name == "item") types[opf.attribute("href")] = opf.attribute("media-type");
+	    continue;
+	}
+
+	if(name == "title" && title.empty()) title = opf.text();
+	else if(name == "creator" && author.empty()) author = opf.text();
+	else if(name == "publisher" && publisher.empty()) publisher = opf.text();
+	else if(name == "meta" && opf.attribute("name") == "cover") coverId = opf.attribute("content");
+	else if(name == "manifest") {
+	    if(!cover) break;
+	    inManifest = true;
+	}
+	else if(name == "reference" && opf.attribute("type") == "cover") {
+	    guideHref = opf.attribute("href");
+	    break;
+	}
+
+	if(!cover && !title.empty() && !author.empty() && !publisher.empty()) break;
+    }
+
+    if(coverIndex < 0 && !guideHref.empty()) {
+	string path = resolve("", guideHref);
+	std::unordered_map<string, string>::iterator t = types.find(path);
+	if(t == types.end() || t->second.compare(0, 6, "image/")) path = pageImage(path);
+	if(!path.empty()) {
+	    coverIndex = 0;
+	    resources.push_back(path);
+	    t = types.find(path);
+	    resourceTypes.push_back(t == types.end() ? "" : t->second);
+	}
+    }
+    return true;
+}
+
+bool Epub::isImage(int pos) {
+    const string & type = resourceTypes[pos];
+    if(!type.empty()) return type.compare(0, 6, "image/") == 0;
+    // no media type: go by the extension
+    string name = resources[pos];
+    size_t dot = name.rfind('.');
+    if(dot == string::npos) return false;
+    string ext = name.substr(dot+1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "gif"
+	|| ext == "webp" || ext == "bmp";
+}
+
+bool Epub::resourceInfo(int pos, ImageInfo & info) {
+    size_t len = IMAGE_PROBE_LEN;
+    string head = zf->getPrefix(base+resources[pos], len);
+    if(head.empty()) return false;
+    size_t need = probeImage(head.data(), head.size(), info);
+    // a JPEG with big metadata blocks before the frame header
+    while(need > head.size() && head.size() == len && len < IMAGE_PROBE_MAX) {
+	len = std::min(std::max(need, len * 2), (size_t)IMAGE_PROBE_MAX);
+	head = zf->getPrefix(base+resources[pos], len);
+	need = probeImage(head.data(), head.size(), info);
+    }
+    return true;
+}
+
+bool Epub::copyResource(int pos, FILE * out) {
+    void * f = zf->openFile(base+resources[pos]);
+    if(!f) return false;
+    char buf[IMAGE_PROBE_LEN];
+    int len;
+    bool ok = true;
+    while(ok && (len = Zip::read(f, buf, sizeof(buf))) > 0)
+	ok = fwrite(buf, 1, len, out) == (size_t)len;
+    Zip::close(f);
+    return ok && len == 0;
+}
+
 Dumper * Epub::getDumper(const char * outdir) {
     return new EpubDumper(this, outdir);
 }
@@ -99,42 +298,54 @@ Epub::~Epub() {
     delete zf;
 }
 
-void EpubDumper::dumpMetadata() {
-    JsonObj meta;
+// keys in alphabetical order, as info.json always had them
+void EpubDumper::writeInfo(MetaWriter & meta) {
     meta.add("author", book->getAuthor());
-    meta.add("title", book->getTitle());
-    meta.add("publisher", book->getPublisher());
     if(epub->getCover() >= 0)
-	meta.add("cover", epub->resourceNames()[epub->getCover()]);
-    vector<JsonObj> res;
+	meta.add("cover", epub->resourceName(epub->getCover()));
+    meta.add("items", epub->itemNames());
+    meta.add("publisher", book->getPublisher());
+    meta.key("res").beginArray();
+    ImageInfo info;
     for(int i = 0; i < epub->resourceCount(); ++i) {
-	JsonObj ares;
-	ares.add("path", epub->resourceNames()[i]);
-	res.push_back(ares);
+	meta.beginObject().add("path", epub->resourceName(i));
+	if(const string * orig = sameAs(epub->resourceName(i))) meta.add("same", *orig);
+	if(epub->isImage(i) && epub->resourceInfo(i, info) && info.width)
+	    meta.add("width", info.width).add("height", info.height);
+	meta.endObject();
     }
-    meta.add("res", res);
-    vector<string> itemNames = epub->itemNames();
-    meta.add("items", itemNames);
-
-    write("info.json", meta.json());
+    meta.endArray();
+    meta.add("title", book->getTitle());
 }
 
 void EpubDumper::dumpText() {
-    vector<string> items = epub->itemNames();
-    int pos;
-    vector<string>::iterator it;
-    for(it = items.begin(), pos = 0; it != items.end(); ++it, ++pos) {
-	write(it->c_str(), epub->getItem(pos));
+    if(infoOnly) return;
+    for(int pos = 0; pos < epub->itemCount(); ++pos) {
+	submit([this, pos]() {
+	    write(epub->itemName(pos).c_str(), epub->getItem(pos));
+	});
     }
 }
 
 void EpubDumper::dumpResources() {
-    vector<string> items = epub->resourceNames();
-    int pos;
-    vector<string>::iterator it;
-    for(it = items.begin(), pos = 0; it != items.end(); ++it, ++pos) {
-	vector<unsigned char> res = epub->getResource(pos);
-	write(it->c_str(), (char*)&res[0], res.size());
-    }    
+    uint32_t crc;
+    uint64_t size;
+
+    for(int pos = 0; pos < epub->resourceCount(); ++pos) {
+	// duplicated fonts and images, by the checksums in the archive
+	const string & name = epub->resourceName(pos);
+	if(epub->resourceSum(pos, crc, size)) {
+	    const string * orig = original(name, pos, crc, size, [this, pos](int first) {
+		return epub->sameResource(first, pos);
+	    });
+	    if(orig && link(name.c_str(), *orig)) continue;
+	}
+	if(infoOnly) continue;
+
+	submit([this, pos]() {
+	    vector<unsigned char> res = epub->getResource(pos);
+	    write(epub->resourceName(pos).c_str(), string(res.begin(), res.end()));
+	});
+    }
 }
 
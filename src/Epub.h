@@ -11,31 +11,57 @@
 
 #include "Ebook.h"
 #include "Zip.h"
+#include "ImageInfo.h"
 #include <vector>
 #include <string>
+#include <stdio.h>
 
 using std::string;
 using std::vector;
 
+// createFromFile modes
+#define EPUB_FULL	0	// metadata, spine and resources
+#define EPUB_METADATA	1	// only title, author and publisher
+#define EPUB_COVER	2	// metadata and the cover, the only resource
+
 class Epub : public Ebook {
 public:
-    static Epub *	createFromFile(const char *fileName);
-    vector<string>	itemNames() { return items; }
-    vector<string>	resourceNames() { return resources; }
-    int			itemCount() { return items.size(); }
-    int			resourceCount() { return resources.size(); }
-    int			getCover() {return coverIndex; }
+    static Epub *	createFromFile(const char *fileName, int mode = EPUB_FULL);
+    // open another book with this object, reusing the archive reader
+    // and the lists' memory; on failure the book is empty
+    bool		reopen(const char *fileName, int mode = EPUB_FULL);
+    const vector<string> &	itemNames() const { return items; }
+    const vector<string> &	resourceNames() const { return resources; }
+    const string &	itemName(int pos) const { return items[pos]; }
+    const string &	resourceName(int pos) const { return resources[pos]; }
+    int			itemCount() const { return items.size(); }
+    int			resourceCount() const { return resources.size(); }
+    int			getCover() const {return coverIndex; }
     string		getItem(int pos) { return zf->getFile(base+items[pos]); }
     vector<unsigned char>	getResource(int pos) { return zf->getBinaryFile(base+resources[pos]); }
+    // checksum and size of a resource, without reading it
+    bool		resourceSum(int pos, uint32_t & crc, uint64_t & size) { return zf->stat(base+resources[pos], crc, size); }
+    // true if a resource is an image, by media type or extension
+    bool		isImage(int pos);
+    // image type and size of a resource, reading only its first bytes
+    bool		resourceInfo(int pos, ImageInfo & info);
+    // true if two resources have the same content
+    bool		sameResource(int a, int b) { return getResource(a) == getResource(b); }
+    // write a resource to out as it's decompressed
+    bool		copyResource(int pos, FILE * out);
     
     Dumper *	getDumper(const char * outdir);
     virtual	~Epub();
 
 private:
-    Epub() : coverIndex(-1) {};
+    Epub() : zf(NULL), coverIndex(-1) {};
     bool check();
+    bool readMetadata(bool cover);
+    string pageImage(const string & page);
+    string opfPath();
     Zip * zf;
     vector<string> items, resources;
+    vector<string> resourceTypes;	// media-type of each resource, if known
     string base;
     int coverIndex;
     const static string dcns, dcpref, opfns, opfpref;
@@ -49,8 +75,10 @@ public:
     };
     
     void dumpResources();
-    void dumpMetadata();
     void dumpText();
+
+protected:
+    void writeInfo(MetaWriter & meta);
     
 private:
     Epub * epub;
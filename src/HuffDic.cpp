@@ -0,0 +1,266 @@
+/* 
+ * HuffDic
+ * Mobipocket's huffman/dictionary decompression
+ * 
+ * Original copyright:
+ *   SumatraPDF project authors
+ *   License: Simplified BSD (see COPYING.BSD) 
+ * 
+ * Modified by:
+ *   Domenico Rotiroti
+ *   License: GPL3 (see COPYING)
+ */
+
+#include "HuffDic.h"
+#include <iostream>
+#include <algorithm>
+
+#define err(msg) std::cerr << "[ERROR] " << msg << std::endl;
+
+#define kHuffHeaderLen 24
+struct HuffHeader
+{
+    char         id[4];             // "HUFF"
+    uint32       hdrLen;            // should be 24
+    // offset of 256 4-byte elements of cache data, in big endian
+    uint32       cacheOffset;       // should be 24 as well
+    // offset of 64 4-byte elements of base table data, in big endian
+    uint32       baseTableOffset;   // should be 1024 + 24
+    // like cacheOffset except data is in little endian
+    uint32       cacheOffsetLE;     // should be 64 + 1024 + 24
+    // like baseTableOffset except data is in little endian
+    uint32       baseTableOffsetLE; // should be 1024 + 64 + 1024 + 24
+};
+STATIC_ASSERT(kHuffHeaderLen == sizeof(HuffHeader), validHuffHeader);
+
+#define kCdicHeaderLen 16
+struct CdicHeader
+{
+    char        id[4];      // "CIDC"
+    uint32      hdrLen;     // should be 16
+    uint32      unknown;
+    uint32      codeLen;
+};
+
+STATIC_ASSERT(kCdicHeaderLen == sizeof(CdicHeader), validCdicHeader);
+
+#define kCacheDataLen      (256*4)
+#define kBaseTableDataLen  (64*4)
+
+#define kHuffRecordMinLen (kHuffHeaderLen +     kCacheDataLen +     kBaseTableDataLen)
+
+// the records are big endian, and are only read
+static inline uint16 ReadBeU16(const uint8 *d)
+{
+    return (uint16)(d[0] << 8 | d[1]);
+}
+
+static inline uint32 ReadBeU32(const uint8 *d)
+{
+    return (uint32)d[0] << 24 | (uint32)d[1] << 16 | (uint32)d[2] << 8 | d[3];
+}
+
+HuffDicTables::HuffDicTables() :
+    codeLength(0), dictsCount(0)
+{
+}
+
+void HuffDicTables::Clear()
+{
+    codeLength = 0;
+    dictsCount = 0;
+    dictData.clear();
+}
+
+bool HuffDicTables::SetHuffData(const uint8 *huffData, size_t huffDataLen)
+{
+    // we conservatively use the big-endian version of the data,
+    // the little endian copy that follows may be missing
+    if (huffDataLen < kHuffRecordMinLen)
+        return false;
+    const HuffHeader *huffHdr = (const HuffHeader*)huffData;
+    uint32 hdrLen = ReadBeU32((const uint8*)&huffHdr->hdrLen);
+    uint32 cacheOffset = ReadBeU32((const uint8*)&huffHdr->cacheOffset);
+    uint32 baseTableOffset = ReadBeU32((const uint8*)&huffHdr->baseTableOffset);
+
+    if (strncmp("HUFF", huffHdr->id, 4))
+        return false;
+    if (hdrLen != kHuffHeaderLen)
+        return false;
+    if (cacheOffset != kHuffHeaderLen)
+        return false;
+    if (baseTableOffset != (cacheOffset + kCacheDataLen))
+        return false;
+
+    for (size_t i = 0; i < 256; i++) {
+        cacheTable[i] = ReadBeU32(huffData + cacheOffset + i * 4);
+    }
+    for (size_t i = 0; i < 64; i++) {
+        baseTable[i] = ReadBeU32(huffData + baseTableOffset + i * 4);
+    }
+    return true;
+}
+
+bool HuffDicTables::AddCdicData(const uint8 *cdicData, size_t cdicDataLen)
+{
+    if (cdicDataLen < kCdicHeaderLen || dictsCount >= kCdicsMax)
+        return false;
+    const CdicHeader *cdicHdr = (const CdicHeader*)cdicData;
+    uint32 hdrLen = ReadBeU32((const uint8*)&cdicHdr->hdrLen);
+    uint32 codeLen = ReadBeU32((const uint8*)&cdicHdr->codeLen);
+
+    if (strncmp("CDIC", cdicHdr->id, 4))
+        return false;
+    if (hdrLen != kCdicHeaderLen)
+        return false;
+    // all the dictionaries use the same code length
+    if ((0 != codeLength && codeLen != codeLength) || codeLen > 16)
+        return false;
+    codeLength = codeLen;
+
+    uint32 size = cdicDataLen - hdrLen;
+    uint32 maxSize = 1 << codeLength;
+    if (maxSize >= size)
+        return false;
+    dictStart[dictsCount] = dictData.size();
+    dictSize[dictsCount] = size;
+    dictData.insert(dictData.end(), cdicData + hdrLen, cdicData + cdicDataLen);
+    ++dictsCount;
+    return true;
+}
+
+HuffDicDecompressor::HuffDicDecompressor(std::shared_ptr<const HuffDicTables> tables,
+        uint32 maxDepth, size_t maxWork) :
+    tables(tables), maxDepth(maxDepth), maxWork(maxWork)
+{
+    // a larger maxDepth grows the stack only if the book needs it
+    stack.reserve(std::min(maxDepth, (uint32)kHuffMaxDepth) + 1);
+}
+
+void HuffDicDecompressor::SetTables(std::shared_ptr<const HuffDicTables> tables,
+        uint32 maxDepth, size_t maxWork)
+{
+    this->tables = tables;
+    this->maxDepth = maxDepth;
+    this->maxWork = maxWork;
+    stack.reserve(std::min(maxDepth, (uint32)kHuffMaxDepth) + 1);
+}
+
+// Read the next code from br: returns 1 if there is one,
+// 0 at the end of the stream and -1 on errors
+int HuffDicDecompressor::NextCode(BitReader& br, uint32& code)
+{
+    if (0 == br.BitsLeft())
+        return 0;
+    uint32 bits = br.Peek(32);
+    if (br.BitsLeft() < 8 && 0 == bits)
+        return 0;
+
+    uint32 v = tables->cacheTable[bits >> 24];
+    uint32 codeLen = v & 0x1f;
+    if (!codeLen) {
+        err("corrupted table, zero code len");
+        return -1;
+    }
+    bool isTerminal = (v & 0x80) != 0;
+
+    if (isTerminal) {
+        code = (v >> 8) - (bits >> (32 - codeLen));
+    } else {
+        uint32 baseVal;
+        codeLen -= 1;
+        do {
+            if (codeLen >= 32) {
+                err("code len > 32 bits");
+                return -1;
+            }
+            baseVal = tables->baseTable[codeLen*2];
+            code = (bits >> (32 - (codeLen+1)));
+            codeLen++;
+        } while (baseVal > code);
+        code = tables->baseTable[1 + ((codeLen - 1) * 2)] - (bits >> (32 - codeLen));
+    }
+
+    if (codeLen > br.BitsLeft()) {
+        err("not enough data");
+        return -1;
+    }
+    br.Eat(codeLen);
+    return 1;
+}
+
+// Compressed dictionary entries are expanded with an explicit stack
+// instead of recursion: the nesting is limited to maxDepth, and at most
+// maxWork codes are decoded, so a bad table can't loop or blow the stack
+size_t HuffDicDecompressor::Decompress(const uint8 *src, size_t srcSize, uint8 *dst, size_t dstSize)
+{
+    const HuffDicTables& t = *tables;
+    size_t dstLeft = dstSize;
+    size_t work = 0;
+    uint32 code;
+
+    // BitReader only reads its data
+    stack.clear();
+    stack.push_back(BitReader((uint8*)src, srcSize));
+
+    while (!stack.empty()) {
+        int res = NextCode(stack.back(), code);
+        if (res < 0)
+            return -1;
+        if (0 == res) {
+            stack.pop_back();
+            continue;
+        }
+        if (++work > maxWork) {
+            err("huffdic work budget exceeded");
+            return -1;
+        }
+
+        uint32 dict = code >> t.codeLength;
+        if ((size_t)dict >= t.dictsCount) {
+            err("invalid dict value");
+            return -1;
+        }
+        code &= ((1 << (t.codeLength)) - 1);
+        const uint8 *dictData = &t.dictData[t.dictStart[dict]];
+        uint32 size = t.dictSize[dict];
+        if (code * 2 + 2 > size) {
+            err("invalid code");
+            return -1;
+        }
+        uint32 offset = ReadBeU16(dictData + code * 2);
+        if (offset + 2 > size) {
+            err("invalid offset");
+            return -1;
+        }
+        uint16 symLen = ReadBeU16(dictData + offset);
+        const uint8 *p = dictData + offset + 2;
+        bool isLiteral = (symLen & 0x8000) != 0;
+        symLen &= 0x7fff;
+        if (offset + 2 + symLen > size) {
+            err("invalid symbol length");
+            return -1;
+        }
+
+        if (!isLiteral) {
+            if (stack.size() > maxDepth) {
+                err("huffdic entries nested too deep");
+                return -1;
+            }
+            stack.push_back(BitReader((uint8*)p, symLen));
+            continue;
+        }
+        if (symLen > 127) {
+            err("symLen too big");
+            return -1;
+        }
+        if (symLen > dstLeft) {
+            err("not enough space");
+            return -1;
+        }
+        memcpy(dst, p, symLen);
+        dst += symLen;
+        dstLeft -= symLen;
+    }
+    return dstSize - dstLeft;
+}
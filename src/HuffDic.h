@@ -0,0 +1,79 @@
+/* 
+ * HuffDic
+ * Mobipocket's huffman/dictionary decompression
+ * 
+ * Original copyright:
+ *   SumatraPDF project authors
+ *   License: Simplified BSD (see COPYING.BSD) 
+ * 
+ * Modified by:
+ *   Domenico Rotiroti
+ *   License: GPL3 (see COPYING)
+ */
+
+#ifndef HuffDic_h
+#define HuffDic_h
+
+#include "Utils.h"
+#include "BitReader.h"
+#include <memory>
+#include <vector>
+
+#define kCdicsMax 32
+
+// default limits for the decoder
+#define kHuffMaxDepth	32
+#define kHuffMaxWork	(64*1024)
+
+// The tables from the HUFF and CDIC records, converted to host order.
+// They are not changed once loaded: a set can be shared (as a
+// shared_ptr<const HuffDicTables>) by decoders in several threads.
+class HuffDicTables
+{
+    friend class HuffDicDecompressor;
+
+    uint32      cacheTable[256];
+    uint32      baseTable[64];
+    uint32      codeLength;
+
+    // all the dictionaries, one after the other
+    std::vector<uint8> dictData;
+    size_t      dictsCount;
+    size_t      dictStart[kCdicsMax];
+    uint32      dictSize[kCdicsMax];
+
+public:
+    HuffDicTables();
+    // forget the tables, keeping the memory for the next ones
+    void Clear();
+    // the records are copied, and left untouched
+    bool SetHuffData(const uint8 *huffData, size_t huffDataLen);
+    bool AddCdicData(const uint8 *cdicData, size_t cdicDataLen);
+};
+
+// Decoding state, one for each thread
+class HuffDicDecompressor
+{
+    std::shared_ptr<const HuffDicTables> tables;
+
+    // streams being decoded: the record, then the
+    // compressed dictionary entries it expands to
+    std::vector<BitReader> stack;
+    uint32      maxDepth;
+    size_t      maxWork;
+
+    int NextCode(BitReader& br, uint32& code);
+
+public:
+    // maxDepth limits the nesting of dictionary entries,
+    // maxWork the codes decoded for each record
+    HuffDicDecompressor(std::shared_ptr<const HuffDicTables> tables,
+            uint32 maxDepth = kHuffMaxDepth, size_t maxWork = kHuffMaxWork);
+    // decode with other tables (or release them, with an empty pointer)
+    void SetTables(std::shared_ptr<const HuffDicTables> tables,
+            uint32 maxDepth = kHuffMaxDepth, size_t maxWork = kHuffMaxWork);
+    // returns the decompressed size, or -1 on errors
+    size_t Decompress(const uint8 *src, size_t srcSize, uint8 *dst, size_t dstSize);
+};
+
+#endif
@@ -0,0 +1,110 @@
+/* 
+ * ImageInfo
+ * Image format and size from the first bytes of the file
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "ImageInfo.h"
+#include <string.h>
+
+#define JPG_MAGIC "\xff\xd8\xff"
+#define PNG_MAGIC "\x89PNG\r\n\x1a\n"
+#define GIF_MAGIC "GIF8"
+#define BMP_MAGIC "BM"
+#define RIFF_MAGIC "RIFF"
+#define LEN(s) (sizeof(s)-1)
+#define HAS(d, len, off, s) ((len) >= (off) + LEN(s) && !memcmp((d) + (off), s, LEN(s)))
+
+static uint32_t be16(const uint8_t * d) { return d[0] << 8 | d[1]; }
+static uint32_t be32(const uint8_t * d) { return (uint32_t)d[0] << 24 | d[1] << 16 | d[2] << 8 | d[3]; }
+static uint32_t le16(const uint8_t * d) { return d[0] | d[1] << 8; }
+static uint32_t le24(const uint8_t * d) { return d[0] | d[1] << 8 | d[2] << 16; }
+static uint32_t le32(const uint8_t * d) { return le24(d) | (uint32_t)d[3] << 24; }
+
+// walk the markers up to a start of frame
+static size_t probeJpeg(const uint8_t * d, size_t len, ImageInfo & info) {
+    size_t pos = 2;
+    while(pos + 4 <= len) {
+	if(d[pos] != 0xff) return 0;
+	uint8_t m = d[pos+1];
+	if(m == 0xff) {			// fill byte
+	    ++pos;
+	    continue;
+	}
+	if(m == 0x01 || (m >= 0xd0 && m <= 0xd8)) {	// no payload
+	    pos += 2;
+	    continue;
+	}
+	if(m == 0xd9 || m == 0xda) return 0;	// end of image, scan
+	// SOF0..SOF15, but DHT, JPG and DAC share the range
+	if(m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) {
+	    if(pos + 9 > len) return pos + 9;
+	    info.height = be16(d + pos + 5);
+	    info.width = be16(d + pos + 7);
+	    return 0;
+	}
+	pos += 2 + be16(d + pos + 2);
+    }
+    // enough for the next marker, if it's a frame header
+    return pos + 9;
+}
+
+// the known BMP info header sizes, "BM" alone is a weak magic
+static bool isDibHeader(uint32_t size) {
+    return size == 12 || size == 40 || size == 52 || size == 56
+	    || size == 64 || size == 108 || size == 124;
+}
+
+static void probeWebp(const uint8_t * d, size_t len, ImageInfo & info) {
+    if(HAS(d, len, 12, "VP8 ") && len >= 30 && d[23] == 0x9d && d[24] == 0x01 && d[25] == 0x2a) {
+	info.width = le16(d + 26) & 0x3fff;
+	info.height = le16(d + 28) & 0x3fff;
+    } else if(HAS(d, len, 12, "VP8L") && len >= 25 && d[20] == 0x2f) {
+	uint32_t bits = le32(d + 21);
+	info.width = (bits & 0x3fff) + 1;
+	info.height = ((bits >> 14) & 0x3fff) + 1;
+    } else if(HAS(d, len, 12, "VP8X") && len >= 30) {
+	info.width = le24(d + 24) + 1;
+	info.height = le24(d + 27) + 1;
+    }
+}
+
+size_t probeImage(const char * data, size_t len, ImageInfo & info) {
+    const uint8_t * d = (const uint8_t *)data;
+    info.type = ".bin";
+    info.width = info.height = 0;
+
+    if(HAS(d, len, 0, JPG_MAGIC)) {
+	info.type = ".jpg";
+	return probeJpeg(d, len, info);
+    }
+    if(HAS(d, len, 0, PNG_MAGIC)) {
+	info.type = ".png";
+	if(HAS(d, len, 12, "IHDR") && len >= 24) {
+	    info.width = be32(d + 16);
+	    info.height = be32(d + 20);
+	}
+    } else if(HAS(d, len, 0, GIF_MAGIC)) {
+	info.type = ".gif";
+	if(len >= 10) {
+	    info.width = le16(d + 6);
+	    info.height = le16(d + 8);
+	}
+    } else if(HAS(d, len, 0, RIFF_MAGIC) && HAS(d, len, 8, "WEBP")) {
+	info.type = ".webp";
+	probeWebp(d, len, info);
+    } else if(HAS(d, len, 0, BMP_MAGIC) && len >= 26 && isDibHeader(le32(d + 14))) {
+	info.type = ".bmp";
+	if(le32(d + 14) == 12) {	// OS/2 header
+	    info.width = le16(d + 18);
+	    info.height = le16(d + 20);
+	} else {
+	    int32_t h = (int32_t)le32(d + 22);	// negative if top-down
+	    info.width = le32(d + 18);
+	    info.height = h < 0 ? -h : h;
+	}
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/* 
+ * ImageInfo
+ * Image format and size from the first bytes of the file
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef IMAGEINFO_H
+#define	IMAGEINFO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// bytes to read for a probe, and the most a JPEG can ask for
+#define IMAGE_PROBE_LEN	4096
+#define IMAGE_PROBE_MAX	(256*1024)
+
+struct ImageInfo {
+    const char *	type;	// file extension, ".bin" if unknown
+    uint32_t		width, height;	// 0 if unknown
+};
+
+// Fill info from the first len bytes of an image (JPEG, PNG, GIF, BMP,
+// WebP). Returns 0 when done, or the length of the prefix needed to
+// find the size (JPEG frame headers can follow large metadata).
+size_t probeImage(const char * data, size_t len, ImageInfo & info);
+
+#endif	/* IMAGEINFO_H */
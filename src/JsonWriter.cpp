@@ -0,0 +1,135 @@
+/* 
+ * JsonWriter
+ * Streaming json output
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "JsonWriter.h"
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+JsonWriter::~JsonWriter() {
+    flush();
+}
+
+void JsonWriter::separator() {
+    if(comma) buf.push_back(',');
+    comma = false;
+}
+
+MetaWriter& JsonWriter::beginObject() {
+    separator();
+    buf.push_back('{');
+    return *this;
+}
+
+MetaWriter& JsonWriter::endObject() {
+    buf.push_back('}');
+    comma = true;
+    check();
+    return *this;
+}
+
+MetaWriter& JsonWriter::beginArray() {
+    separator();
+    buf.push_back('[');
+    return *this;
+}
+
+MetaWriter& JsonWriter::endArray() {
+    buf.push_back(']');
+    comma = true;
+    check();
+    return *this;
+}
+
+MetaWriter& JsonWriter::key(const string & k) {
+    separator();
+    buf.push_back('"');
+    escape(k.data(), k.size());
+    buf.append("\":");
+    return *this;
+}
+
+MetaWriter& JsonWriter::value(const char * v, size_t len) {
+    separator();
+    buf.push_back('"');
+    escape(v, len);
+    buf.push_back('"');
+    comma = true;
+    check();
+    return *this;
+}
+
+MetaWriter& JsonWriter::value(long v) {
+    char num[24];
+    separator();
+    buf.append(num, snprintf(num, sizeof(num), "%ld", v));
+    comma = true;
+    check();
+    return *this;
+}
+
+MetaWriter& JsonWriter::endRecord() {
+    buf.push_back('\n');
+    comma = false;
+    check();
+    return *this;
+}
+
+// characters that need escaping: quote, backslash, controls,
+// and the slash (escaped for safe embedding in html)
+static inline bool special(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\' || c == '/';
+}
+
+void JsonWriter::escape(const char * s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char * end = s + len, * run = s;
+
+    while(s < end) {
+#ifdef __SSE2__
+	// skip 16 plain characters at a time
+	const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'),
+		slash = _mm_set1_epi8('/'), ctl = _mm_set1_epi8(0x1f);
+	while(end - s >= 16) {
+	    __m128i x = _mm_loadu_si128((const __m128i *)s);
+	    __m128i m = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, bslash)),
+		    _mm_or_si128(_mm_cmpeq_epi8(x, slash),
+			    _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x)));
+	    int mask = _mm_movemask_epi8(m);
+	    if(mask) {
+		s += __builtin_ctz(mask);
+		break;
+	    }
+	    s += 16;
+	}
+#endif
+	while(s < end && !special(*s)) ++s;
+	if(s == end) break;
+
+	buf.append(run, s - run);
+	unsigned char c = *s++;
+	run = s;
+	buf.push_back('\\');
+	switch(c) {
+	    case '"': case '\\': case '/': buf.push_back(c); break;
+	    case '\b': buf.push_back('b'); break;
+	    case '\f': buf.push_back('f'); break;
+	    case '\n': buf.push_back('n'); break;
+	    case '\r': buf.push_back('r'); break;
+	    case '\t': buf.push_back('t'); break;
+	    default:
+		buf.append("u00");
+		buf.push_back(hex[c >> 4]);
+		buf.push_back(hex[c & 0xf]);
+	}
+    }
+    buf.append(run, end - run);
+}
@@ -0,0 +1,39 @@
+/* 
+ * JsonWriter
+ * Streaming json output
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef JSONWRITER_H
+#define	JSONWRITER_H
+
+#include "MetaWriter.h"
+
+class JsonWriter : public MetaWriter {
+public:
+    JsonWriter(int fd = -1) : MetaWriter(fd), comma(false) {}
+    virtual ~JsonWriter();
+
+    using MetaWriter::value;
+    MetaWriter& beginObject();
+    MetaWriter& endObject();
+    MetaWriter& beginArray();
+    MetaWriter& endArray();
+    MetaWriter& key(const string & k);
+    MetaWriter& value(const char * v, size_t len);
+    MetaWriter& value(long v);
+    // ends the current line
+    MetaWriter& endRecord();
+
+    const char * extension() { return ".json"; }
+
+private:
+    void separator();
+    void escape(const char * s, size_t len);
+
+    bool comma;
+};
+
+#endif	/* JSONWRITER_H */
@@ -0,0 +1,37 @@
+/* 
+ * MetaWriter
+ * Common interface of the metadata encoders
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "MetaWriter.h"
+#include "JsonWriter.h"
+#include "Cbor.h"
+#include <unistd.h>
+
+// buffer size before data is sent to the fd
+#define FLUSH_SIZE (64*1024)
+
+MetaWriter * MetaWriter::create(int format, int fd) {
+    if(format == META_CBOR) return new CborWriter(fd);
+    return new JsonWriter(fd);
+}
+
+void MetaWriter::check() {
+    if(fd >= 0 && buf.size() >= FLUSH_SIZE) flush();
+}
+
+void MetaWriter::flush() {
+    if(fd < 0) return;
+    const char * p = buf.data();
+    size_t left = buf.size();
+    while(left > 0) {
+	ssize_t n = ::write(fd, p, left);
+	if(n <= 0) break;
+	p += n;
+	left -= n;
+    }
+    buf.clear();
+}
@@ -0,0 +1,69 @@
+/* 
+ * MetaWriter
+ * Common interface of the metadata encoders
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef METAWRITER_H
+#define	METAWRITER_H
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// metadata formats
+#define META_JSON	0
+#define META_CBOR	1
+
+/*
+ * Values are written as they are added, to a memory buffer
+ * or to a file descriptor (buffered, see flush()).
+ * Nesting is up to the caller: every begin needs its end.
+ */
+class MetaWriter {
+public:
+    virtual ~MetaWriter() {}
+
+    virtual MetaWriter& beginObject() = 0;
+    virtual MetaWriter& endObject() = 0;
+    virtual MetaWriter& beginArray() = 0;
+    virtual MetaWriter& endArray() = 0;
+    virtual MetaWriter& key(const string & k) = 0;
+    virtual MetaWriter& value(const char * v, size_t len) = 0;
+    virtual MetaWriter& value(long v) = 0;
+    // end of a top level record, in batch output
+    virtual MetaWriter& endRecord() = 0;
+
+    MetaWriter& value(const string & v) { return value(v.data(), v.size()); }
+    MetaWriter& add(const string & k, const string & v) { key(k); return value(v); }
+    MetaWriter& add(const string & k, long v) { key(k); return value(v); }
+    MetaWriter& add(const string & k, const vector<string> & v) {
+	key(k).beginArray();
+	for(vector<string>::const_iterator it = v.begin(); it != v.end(); ++it)
+	    value(*it);
+	return endArray();
+    }
+
+    /* The data written so far (memory buffer only) */
+    string & str() { return buf; }
+    /* Send the buffer to the file descriptor */
+    void flush();
+
+    /* File name suffix for the format */
+    virtual const char * extension() = 0;
+
+    static MetaWriter * create(int format, int fd = -1);
+
+protected:
+    MetaWriter(int fd) : fd(fd) {}
+    void check();
+
+    string buf;
+    int fd;
+};
+
+#endif	/* METAWRITER_H */
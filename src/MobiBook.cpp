@@ -12,28 +12,22 @@
  */
 
 #include "MobiBook.h"
-#include "BitReader.h"
+#include "HuffDic.h"
+#include "Charset.h"
+#include "MobiIndex.h"
+#include "ImageInfo.h"
 #include "MobiDumper.h"
 
 #include <time.h>
 #include <iostream>
 #include <string.h>
 #include <stdlib.h>
-
-// From (Base)Utils
-inline void *memdup(void *data, size_t len)
-{
-    void *dup = malloc(len);
-    if (dup)
-        memcpy(dup, data, len);
-    return dup;
-}
-#define _memdup(ptr) memdup(ptr, sizeof(*(ptr)))
+#include <algorithm>
 
 /* Ugly name, but the whole point is to make things shorter.
-   SAZA = Struct Allocate and Zero memory for Array
+   SAZA = Struct Allocate and Zero memory for Array, in the book's arena
    (note: use operator new for single structs/classes) */
-#define SAZA(struct_name, n) (struct_name *)calloc((n), sizeof(struct_name))
+#define SAZA(struct_name, n) (struct_name *)arena.calloc((n), sizeof(struct_name))
 
 
 // Parse mobi format http://wiki.mobileread.com/wiki/MOBI
@@ -151,10 +145,12 @@ struct ExthHeader {
 
 struct ExthRecord {
     uint32	type;   
-    uint32	len; 
-    void *	data;
+    uint32	len;    // including type and len
+    char	data[1];
 };
 
+#define kExthRecordHeaderLen 8
+
 // change big-endian int16 to little-endian (our native format)
 static void SwapU16(uint16& i)
 {
@@ -166,6 +162,16 @@ static void SwapU32(uint32& i)
     i = BEtoHl(i);
 }
 
+static uint16 ReadBeU16(const uint8 *d)
+{
+    return (uint16)(d[0] << 8 | d[1]);
+}
+
+static uint32 ReadBeU32(const uint8 *d)
+{
+    return (uint32)d[0] << 24 | (uint32)d[1] << 16 | (uint32)d[2] << 8 | d[3];
+}
+
 // Uncompress source data compressed with PalmDoc compression into a buffer.
 // Returns size of uncompressed data or -1 on error (if destination buffer too small)
 static size_t PalmdocUncompress(uint8 *src, size_t srcLen, uint8 *dst, size_t dstLen)
@@ -224,42 +230,6 @@ static size_t PalmdocUncompress(uint8 *src, size_t srcLen, uint8 *dst, size_t ds
     return dst - dstOrig;
 }
 
-#define kHuffHeaderLen 24
-struct HuffHeader
-{
-    char         id[4];             // "HUFF"
-    uint32       hdrLen;            // should be 24
-    // offset of 256 4-byte elements of cache data, in big endian
-    uint32       cacheOffset;       // should be 24 as well
-    // offset of 64 4-byte elements of base table data, in big endian
-    uint32       baseTableOffset;   // should be 1024 + 24
-    // like cacheOffset except data is in little endian
-    uint32       cacheOffsetLE;     // should be 64 + 1024 + 24
-    // like baseTableOffset except data is in little endian
-    uint32       baseTableOffsetLE; // should be 1024 + 64 + 1024 + 24
-};
-STATIC_ASSERT(kHuffHeaderLen == sizeof(HuffHeader), validHuffHeader);
-
-#define kCdicHeaderLen 16
-struct CdicHeader
-{
-    char        id[4];      // "CIDC"
-    uint32      hdrLen;     // should be 16
-    uint32      unknown;
-    uint32      codeLen;
-};
-
-STATIC_ASSERT(kCdicHeaderLen == sizeof(CdicHeader), validCdicHeader);
-
-#define kCacheDataLen      (256*4)
-#define kBaseTableDataLen  (64*4)
-
-#define kHuffRecordMinLen (kHuffHeaderLen +     kCacheDataLen +     kBaseTableDataLen)
-#define kHuffRecordLen    (kHuffHeaderLen + 2 * kCacheDataLen + 2 * kBaseTableDataLen)
-
-#define kCdicsMax 32
-
-
 static off_t filesize(const char * localpath)
 {
   struct stat sb;
@@ -268,213 +238,6 @@ static off_t filesize(const char * localpath)
   return sb.st_size;
 }
 
-
-class HuffDicDecompressor
-{
-    // underlying data for cache and baseTable
-    // (an optimization to only do one allocation instead of two)
-    uint8 *     huffmanData;
-
-    uint32 *    cacheTable;
-    uint32 *    baseTable;
-
-    size_t      dictsCount;
-    uint8 *     dicts[kCdicsMax];
-    uint32      dictSize[kCdicsMax];
-
-    uint32      code_length;
-
-public:
-    HuffDicDecompressor();
-    ~HuffDicDecompressor();
-    bool SetHuffData(uint8 *huffData, size_t huffDataLen);
-    bool AddCdicData(uint8 *cdicData, uint32 cdicDataLen);
-    size_t Decompress(uint8 *src, size_t octets, uint8 *dst, size_t avail_in);
-    bool DecodeOne(uint32 code, uint8 *& dst, size_t& dstLeft);
-};
-
-HuffDicDecompressor::HuffDicDecompressor() :
-    huffmanData(NULL), cacheTable(NULL), baseTable(NULL),
-    code_length(0), dictsCount(0)
-{
-}
-
-HuffDicDecompressor::~HuffDicDecompressor()
-{
-    for (size_t i = 0; i < dictsCount; i++) {
-        free(dicts[i]);
-    }
-    free(huffmanData);
-}
-
-uint16 ReadBeU16(uint8 *d)
-{
-    uint16 v = *((uint16*)d);
-    SwapU16(v);
-    return v;
-}
-
-bool HuffDicDecompressor::DecodeOne(uint32 code, uint8 *& dst, size_t& dstLeft)
-{
-    uint16 dict = code >> code_length;
-    if ((size_t)dict > dictsCount) {
-        err("invalid dict value");
-        return false;
-    }
-    code &= ((1 << (code_length)) - 1);
-    uint16 offset = ReadBeU16(dicts[dict] + code * 2);
-
-    if ((uint32)offset > dictSize[dict]) {
-        err("invalid offset");
-        return false;
-    }
-    uint16 symLen = ReadBeU16(dicts[dict] + offset);
-    uint8 *p = dicts[dict] + offset + 2;
-
-    if (!(symLen & 0x8000)) {
-        size_t res = Decompress(p, symLen, dst, dstLeft);
-        if (-1 == res)
-            return false;
-        dst += res;
-        assert(dstLeft >= res);
-        dstLeft -= res;
-    } else {
-        symLen &= 0x7fff;
-        if (symLen > 127) {
-            err("symLen too big");
-            return false;
-        }
-        if (symLen > dstLeft) {
-            err("not enough space");
-            return false;
-        }
-        memcpy(dst, p, symLen);
-        dst += symLen;
-        dstLeft -= symLen;
-    }
-    return true;
-}
-
-size_t HuffDicDecompressor::Decompress(uint8 *src, size_t srcSize, uint8 *dst, size_t dstSize)
-{
-    uint32    bitsConsumed = 0;
-    uint32    bits = 0;
-
-    BitReader br(src, srcSize);
-    size_t      dstLeft = dstSize;
-
-    for (;;) {
-        if (bitsConsumed > br.BitsLeft()) {
-            err("not enough data");
-            return -1;
-        }
-        br.Eat(bitsConsumed);
-        if (0 == br.BitsLeft())
-            break;
-
-        bits = br.Peek(32);
-        if (br.BitsLeft() < 8 && 0 == bits)
-            break;
-        uint32 v = cacheTable[bits >> 24];
-        uint32 codeLen = v & 0x1f;
-        if (!codeLen) {
-            err("corrupted table, zero code len");
-            return -1;
-        }
-        bool isTerminal = (v & 0x80) != 0;
-
-        uint32 code;
-        if (isTerminal) {
-            code = (v >> 8) - (bits >> (32 - codeLen));
-        } else {
-            uint32 baseVal;
-            codeLen -= 1;
-            do {
-                baseVal = baseTable[codeLen*2];
-                code = (bits >> (32 - (codeLen+1)));
-                codeLen++;
-                if (codeLen > 32) {
-                    err("code len > 32 bits");
-                    return -1;
-                }
-            } while (baseVal > code);
-            code = baseTable[1 + ((codeLen - 1) * 2)] - (bits >> (32 - codeLen));
-        }
-
-        if (!DecodeOne(code, dst, dstLeft))
-            return -1;
-        bitsConsumed = codeLen;
-    }
-
-    if (br.BitsLeft() > 0 && 0 != bits) {
-        err("compressed data left");
-    }
-    return dstSize - dstLeft;
-}
-
-bool HuffDicDecompressor::SetHuffData(uint8 *huffData, size_t huffDataLen)
-{
-    // for now catch cases where we don't have both big endian and little endian
-    // versions of the data
-    assert(kHuffRecordLen == huffDataLen);
-    // but conservatively assume we only need big endian version
-    if (huffDataLen < kHuffRecordMinLen)
-        return false;
-    HuffHeader *huffHdr = (HuffHeader*)huffData;
-    SwapU32(huffHdr->hdrLen);
-    SwapU32(huffHdr->cacheOffset);
-    SwapU32(huffHdr->baseTableOffset);
-
-    if (!strncmp("HUFF", huffHdr->id, 4))
-        return false;
-    assert(huffHdr->hdrLen == kHuffHeaderLen);
-    if (huffHdr->hdrLen != kHuffHeaderLen)
-        return false;
-    if (huffHdr->cacheOffset != kHuffHeaderLen)
-        return false;
-    if (huffHdr->baseTableOffset != (huffHdr->cacheOffset + kCacheDataLen))
-        return false;
-    assert(NULL == huffmanData);
-    huffmanData = (uint8*)memdup(huffData, huffDataLen);
-    if (!huffmanData)
-        return false;
-    // we conservatively use the big-endian version of the data,
-    cacheTable = (uint32*)(huffmanData + huffHdr->cacheOffset);
-    for (size_t i = 0; i < 256; i++) {
-        SwapU32(cacheTable[i]);
-    }
-    baseTable = (uint32*)(huffmanData + huffHdr->baseTableOffset);
-    for (size_t i = 0; i < 64; i++) {
-        SwapU32(baseTable[i]);
-    }
-    return true;
-}
-
-bool HuffDicDecompressor::AddCdicData(uint8 *cdicData, uint32 cdicDataLen)
-{
-    CdicHeader *cdicHdr = (CdicHeader*)cdicData;
-    SwapU32(cdicHdr->hdrLen);
-    SwapU32(cdicHdr->codeLen);
-
-    assert((0 == code_length) || (cdicHdr->codeLen == code_length));
-    code_length = cdicHdr->codeLen;
-
-    if (!strncmp("CDIC", cdicHdr->id, 4))
-        return false;
-    assert(cdicHdr->hdrLen == kCdicHeaderLen);
-    if (cdicHdr->hdrLen != kCdicHeaderLen)
-        return false;
-    uint32 size = cdicDataLen - cdicHdr->hdrLen;
-
-    uint32 maxSize = 1 << code_length;
-    if (maxSize >= size)
-        return false;
-    dicts[dictsCount] = (uint8*)memdup(cdicData + cdicHdr->hdrLen, size);
-    dictSize[dictsCount] = size;
-    ++dictsCount;
-    return true;
-}
-
 static bool IsMobiPdb(PdbHeader *pdbHdr)
 {
     return (strncmp(pdbHdr->type, MOBI_TYPE_CREATOR, 8) == 0);
@@ -495,29 +258,79 @@ static bool IsValidCompression(int comprType)
 MobiBook::MobiBook() :
     recHeaders(NULL), firstRecData(NULL),
     isMobi(false), docRecCount(0), compressionType(0), docUncompressedSize(0),
-    doc(""), multibyte(false), trailersCount(0), imageFirstRec(0),
-    imagesCount(0), images(NULL), bufDynamic(NULL), bufDynamicSize(0),
-    coverImage(-1), huffDic(NULL), textEncoding(CP_UTF8)
+    docRecSize(0), textEncoding(CP_UTF8),
+    textBase(0), kf8(false), kf8Text(false), kf8Base(0), ncxRec(0xffffffff),
+    multibyte(false), trailersCount(0), imageFirstRec(0), coverImage(-1), locale(0),
+    exthEncoding(CP_UTF8), bufDynamic(NULL), bufDynamicSize(0),
+    images(NULL), doc(""), rawTextSize(0), linksIndexed(false),
+    huffDic(NULL), huffMaxDepth(kHuffMaxDepth), huffMaxWork(kHuffMaxWork),
+    imagesCount(0)
 {
 }
 
+// Back to the state of a new object, but keep the buffers
+void MobiBook::reset()
+{
+    if (fileHandle)
+        fclose(fileHandle);
+    fileHandle = NULL;
+    fileName = NULL;
+    title.clear();
+    author.clear();
+    publisher.clear();
+
+    recHeaders = NULL;
+    firstRecData = NULL;
+    images = NULL;
+    arena.reset();
+
+    isMobi = false;
+    docRecCount = 0;
+    compressionType = 0;
+    docUncompressedSize = 0;
+    docRecSize = 0;
+    textEncoding = CP_UTF8;
+    textBase = 0;
+    kf8 = kf8Text = false;
+    kf8Base = 0;
+    flows.clear();
+    ncxRec = 0xffffffff;
+    toc.clear();
+    multibyte = false;
+    trailersCount = 0;
+    imageFirstRec = 0;
+    imagesCount = 0;
+    coverImage = -1;
+    locale = 0;
+    exth.clear();
+    exthEncoding = CP_UTF8;
+
+    doc.clear();
+    textMap.clear();
+    recEnds.clear();
+    rawTextSize = 0;
+    linksIndexed = false;
+    anchors.clear();
+
+    // the decoder lets the tables go: if nobody else
+    // holds them, they're reused for the next book
+    if (huffDic)
+        huffDic->SetTables(std::shared_ptr<const HuffDicTables>());
+    if (huffTables.use_count() == 1)
+        spareTables.swap(huffTables);
+    huffTables.reset();
+}
+
 MobiBook::~MobiBook()
 {
-    fclose(fileHandle);
-    free(fileName);
-    free(firstRecData);
-    free(recHeaders);
+    // headers, images and file name are in the arena
+    if (fileHandle)
+        fclose(fileHandle);
     free(bufDynamic);
-    if(images) {
-        for (size_t i = 0; i < imagesCount; i++) {
-            if(images[i].data) free(images[i].data);
-        }
-        free(images);
-    }
     delete huffDic;
 }
 
-bool MobiBook::parseHeader()
+bool MobiBook::parseHeader(unsigned int flags)
 {
     DWORD bytesRead;
     bytesRead = fread((void*)&pdbHeader, 1, kPdbHeaderLen, fileHandle);
@@ -572,7 +385,7 @@ bool MobiBook::parseHeader()
     }
 
     assert(NULL == firstRecData);
-    firstRecData = (char*)memdup(buf, recLeft);
+    firstRecData = (char*)arena.dup(buf, recLeft);
     if (!firstRecData)
         return false;
     char *currRecPos = firstRecData;
@@ -599,6 +412,7 @@ bool MobiBook::parseHeader()
 
     docRecCount = palmDocHdr->recordsCount;
     docUncompressedSize = palmDocHdr->uncompressedDocSize;
+    docRecSize = palmDocHdr->maxRecSize;
     compressionType = palmDocHdr->compressionType;
 
     if (0 == recLeft) {
@@ -642,6 +456,9 @@ bool MobiBook::parseHeader()
         if (0 == imageFirstRec) {
             // I don't think this should ever happen but I've seen it
             imagesCount = 0;
+        } else if (mobiHdr->mobiFormatVersion >= 8) {
+            // no last content record in KF8 headers
+            imagesCount = countImageRecords();
         } else
             //imagesCount = pdbHeader.numRecords - mobiHdr->imageFirstRec;
 	    imagesCount = mobiHdr->lastContentRecord - mobiHdr->imageFirstRec +1;
@@ -654,6 +471,9 @@ bool MobiBook::parseHeader()
     currRecPos += hdrLen;
     recLeft -= hdrLen;
     bool hasExtraFlags = (hdrLen >= 228); // TODO: also only if mobiFormatVersion >= 5?
+    if (hdrLen >= kMobiHeaderLen) {
+        ncxRec = ReadBeU32((uint8*)&mobiHdr->indxRec);
+    }
 
     if (hasExtraFlags) {
         SwapU16(mobiHdr->extraDataFlags);
@@ -677,64 +497,222 @@ bool MobiBook::parseHeader()
 	SwapU32(eh->recCount);
 	
 	currRecPos += sizeof(ExthHeader);
+	recLeft = recLeft > sizeof(ExthHeader) ? recLeft - sizeof(ExthHeader) : 0;
+	// index the records where they are, by type
 	ExthRecord * rec;
-	uint32 coverOffset;
-	for(int i = 0; i < eh->recCount; ++i) {
+	for(uint32 i = 0; i < eh->recCount && recLeft >= kExthRecordHeaderLen; ++i) {
 	    rec = (ExthRecord*)currRecPos;
 	    SwapU32(rec->len);
 	    SwapU32(rec->type);
-
-	    switch(rec->type) {
-		case 100: 
-		    author.append( (char*) &rec->data /*, rec->len*/);
-		    break;
-		case 101:
-		    publisher.append( (char*) &rec->data /*, rec->len*/);
-		    break;
-		case 201:
-		    coverOffset = (uint32) rec->data;
-		    SwapU32(coverOffset);
-		    coverImage = coverOffset;
-		    break;
-		case 503: //if present, it's a better choice for title
-		    title = (char*) &rec->data;
-		    break;
-		default:    
-		    break;
+	    if (rec->len < kExthRecordHeaderLen || rec->len > recLeft) {
+		err("invalid EXTH record");
+		break;
 	    }
-
-	    currRecPos += (rec->len);
+	    ExthEntry entry = { rec->type, (uint32)(rec->data - firstRecData),
+		    rec->len - kExthRecordHeaderLen };
+	    exth.push_back(entry);
+	    currRecPos += rec->len;
+	    recLeft -= rec->len;
 	}
+	std::stable_sort(exth.begin(), exth.end());
+    }
+
+    // the metadata is in the text encoding too
+    exthEncoding = textEncoding;
+    if (isLegacyCodePage(textEncoding))
+        title = toUtf8(textEncoding, title);
+    //if present, it's a better choice for title
+    if (getExthCount(EXTH_TITLE))
+        title = getExthString(EXTH_TITLE);
+    author = getExthStrings(EXTH_AUTHOR, " & ");
+    publisher = getExthStrings(EXTH_PUBLISHER, " & ");
+
+    size_t len;
+    const char *data = getExth(EXTH_COVER, len);
+    if (data && len >= 4)
+        coverImage = ReadBeU32((uint8*)data);
+    data = getExth(EXTH_KF8_BOUNDARY, len);
+    if (data && len >= 4)
+        kf8Base = ReadBeU32((uint8*)data);
+
+    // KF8: a whole azw3 book, or the section after the BOUNDARY
+    // record in combination files
+    uint32 huffFirst = mobiHdr->huffmanFirstRec;
+    uint32 huffCount = mobiHdr->huffmanRecCount;
+    if (mobiHdr->mobiFormatVersion >= 8) {
+        kf8 = true;
+        kf8Base = 0;
+        if (!parseKf8Header(huffFirst, huffCount))
+            return false;
+    } else if (kf8Base > 0 && kf8Base < pdbHeader.numRecords) {
+        size_t len;
+        char *rec = readRecord(kf8Base - 1, len);
+        kf8 = rec && len >= 8 && !strncmp(rec, "BOUNDARY", 8);
+        if (kf8 && (flags & MOBI_KF8) && !parseKf8Header(huffFirst, huffCount))
+            return false;
     }
+    if (!kf8)
+        kf8Base = 0;
 
+    // just enough to find the cover
+    if (flags & MOBI_COVER)
+        return true;
 
-    if (palmDocHdr->compressionType == COMPRESSION_HUFF) {
+    if (compressionType == COMPRESSION_HUFF) {
         assert(isMobi);
         size_t recSize;
-        char *recData = readRecord(mobiHdr->huffmanFirstRec, recSize);
+        char *recData = readRecord(textBase + huffFirst, recSize);
         if (!recData)
             return false;
-        size_t cdicsCount = mobiHdr->huffmanRecCount - 1;
-        assert(cdicsCount <= kCdicsMax);
+        size_t cdicsCount = huffCount - 1;
         if (cdicsCount > kCdicsMax)
             return false;
-        assert(NULL == huffDic);
-        huffDic = new HuffDicDecompressor();
-        if (!huffDic->SetHuffData((uint8*)recData, recSize))
+        if (spareTables)
+            huffTables.swap(spareTables);
+        else
+            huffTables.reset(new HuffDicTables());
+        HuffDicTables *tables = huffTables.get();
+        tables->Clear();
+        if (!tables->SetHuffData((uint8*)recData, recSize))
             return false;
         for (size_t i = 0; i < cdicsCount; i++) {
-            recData = readRecord(mobiHdr->huffmanFirstRec + 1 + i, recSize);
+            recData = readRecord(textBase + huffFirst + 1 + i, recSize);
             if (!recData)
                 return false;
-            if (!huffDic->AddCdicData((uint8*)recData, recSize))
+            if (!tables->AddCdicData((uint8*)recData, recSize))
                 return false;
         }
+        if (huffDic)
+            huffDic->SetTables(huffTables, huffMaxDepth, huffMaxWork);
+        else
+            huffDic = new HuffDicDecompressor(huffTables, huffMaxDepth, huffMaxWork);
     }
 
+    // a broken index is no reason to refuse the book
+    if (ncxRec != 0xffffffff && !loadToc())
+        toc.clear();
     loadImages();
     return true;
 }
 
+// KF8 record 0 (offsets from the record start)
+#define kKf8EncodingOffset	0x1c
+#define kKf8HuffFirstOffset	0x70
+#define kKf8HuffCountOffset	0x74
+#define kKf8FdstOffset		0xc0
+#define kKf8FdstCountOffset	0xc4
+#define kKf8ExtraFlagsOffset	0xf2
+#define kKf8HeaderMinLen	0xf4
+#define kKf8NcxOffset		0xf4
+
+// Make the KF8 section at kf8Base the text section
+bool MobiBook::parseKf8Header(uint32& huffFirst, uint32& huffCount)
+{
+    size_t len;
+    uint8 *rec = (uint8*)readRecord(kf8Base, len);
+    if (!rec || len < kKf8HeaderMinLen || strncmp("MOBI", (char*)rec + kPalmDocHeaderLen, 4)) {
+        err("invalid KF8 header");
+        return false;
+    }
+    if (!IsValidCompression(ReadBeU16(rec))) {
+        err("unknown compression type");
+        return false;
+    }
+    textBase = kf8Base;
+    kf8Text = true;
+    compressionType = ReadBeU16(rec);
+    docUncompressedSize = ReadBeU32(rec + 4);
+    docRecCount = ReadBeU16(rec + 8);
+    docRecSize = ReadBeU16(rec + 10);
+    textEncoding = ReadBeU32(rec + kKf8EncodingOffset);
+    ncxRec = (len >= kKf8NcxOffset + 4) ? ReadBeU32(rec + kKf8NcxOffset) : 0xffffffff;
+    huffFirst = ReadBeU32(rec + kKf8HuffFirstOffset);
+    huffCount = ReadBeU32(rec + kKf8HuffCountOffset);
+
+    uint16 flags = ReadBeU16(rec + kKf8ExtraFlagsOffset);
+    multibyte = ((flags & 1) != 0);
+    trailersCount = 0;
+    while (flags > 1) {
+        if (0 != (flags & 2))
+            trailersCount++;
+        flags = flags >> 1;
+    }
+    return loadFlows(ReadBeU32(rec + kKf8FdstOffset), ReadBeU32(rec + kKf8FdstCountOffset));
+}
+
+// The FDST record: start and end of each flow in the text
+bool MobiBook::loadFlows(size_t fdstRec, size_t fdstCount)
+{
+    flows.clear();
+    size_t len;
+    uint8 *rec = NULL;
+    if (fdstCount > 1 && textBase + fdstRec < pdbHeader.numRecords)
+        rec = (uint8*)readRecord(textBase + fdstRec, len);
+    if (!rec || len < 12 || strncmp("FDST", (char*)rec, 4)) {
+        // everything in a single flow
+        Kf8Flow all = { 0, (uint32)docUncompressedSize };
+        flows.push_back(all);
+        return true;
+    }
+    size_t off = ReadBeU32(rec + 4), count = ReadBeU32(rec + 8);
+    if (off > len || count > (len - off) / 8) {
+        err("invalid FDST record");
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        Kf8Flow fl = { ReadBeU32(rec + off + i * 8), ReadBeU32(rec + off + i * 8 + 4) };
+        if (fl.start > fl.end || fl.end > docUncompressedSize) {
+            err("invalid FDST entry");
+            return false;
+        }
+        flows.push_back(fl);
+    }
+    return true;
+}
+
+// NCX index tags
+#define kNcxTagOffset	1
+#define kNcxTagLength	2
+#define kNcxTagLabel	3
+#define kNcxTagDepth	4
+#define kNcxTagParent	21
+
+// The NCX index: labels and text offsets of the table of contents
+bool MobiBook::loadToc()
+{
+    MobiIndex idx;
+    bool ok = idx.parse([this](size_t n, std::string& out) {
+        size_t len;
+        if (textBase + ncxRec + n >= pdbHeader.numRecords)
+            return false;
+        char *rec = readRecord(textBase + ncxRec + n, len);
+        if (!rec)
+            return false;
+        out.assign(rec, len);
+        return true;
+    });
+    if (!ok) {
+        err("invalid NCX index");
+        return false;
+    }
+    toc.resize(idx.entries.size());
+    for (size_t i = 0; i < idx.entries.size(); i++) {
+        const MobiIndex::Entry& e = idx.entries[i];
+        MobiTocEntry& t = toc[i];
+        t.pos = e.value(kNcxTagOffset, 0);
+        t.len = e.value(kNcxTagLength, 0);
+        t.depth = e.value(kNcxTagDepth, 0);
+        t.parent = (int)e.value(kNcxTagParent, (uint32)-1);
+        if (t.parent >= (int)idx.entries.size())
+            t.parent = -1;
+        if (e.tags.count(kNcxTagLabel))
+            t.label = idx.cncx(e.value(kNcxTagLabel, 0));
+        if (isLegacyCodePage(idx.encoding))
+            t.label = toUtf8(idx.encoding, t.label);
+    }
+    return true;
+}
+
 #define EOF_REC   0xe98e0d0a
 #define FLIS_REC  0x464c4953 // 'FLIS'
 #define FCIS_REC  0x46434953 // 'FCIS
@@ -773,18 +751,25 @@ static bool KnownNonImageRec(uint8 *data, size_t dataLen)
     return false;
 }
 
-#define JPG_MAGIC "\xff\xd8\xff\xe0"
-#define PNG_MAGIC "\x89PNG"
-#define GIF_MAGIC "GIF8"
-#define TYPE(data, type) !strncmp((char*)data, type##_MAGIC, strlen(type##_MAGIC))
-
-static char * ImageType(uint8 *data, size_t dataLen)
+// KF8: the image records from imageFirstRec, up to the first known
+// non-image record (FDST, FLIS, FCIS...) or the EOF record. Only the
+// first bytes of each record are read
+size_t MobiBook::countImageRecords()
 {
-    //return NULL != GfxFileExtFromData((char*)data, dataLen);
-    if(TYPE(data, JPG)) return strdup(".jpg");
-    if(TYPE(data, PNG)) return strdup(".png");
-    if(TYPE(data, GIF)) return strdup(".gif");
-    return strdup(".bin");
+    uint8 sig[4];
+    size_t recNo;
+    for (recNo = imageFirstRec; recNo < pdbHeader.numRecords; recNo++) {
+        size_t recSize = getRecordSize(recNo);
+        size_t len = std::min(recSize, sizeof(sig));
+        if (fseek(fileHandle, recHeaders[recNo].offset, SEEK_SET) != 0 ||
+                fread(sig, 1, len, fileHandle) != len)
+            break;
+        if (0 == len)
+            continue;
+        if (IsEofRecord(sig, recSize) || KnownNonImageRec(sig, len))
+            break;
+    }
+    return recNo - imageFirstRec;
 }
 
 // return false if we should stop loading images (because we
@@ -802,11 +787,16 @@ bool MobiBook::loadImage(size_t imageNo)
     if (KnownNonImageRec(imgData, imgDataLen))
         return true;
 
-    images[imageNo].data = (char*)memdup(imgData, imgDataLen);
+    images[imageNo].data = (char*)arena.dup(imgData, imgDataLen);
     if (!images[imageNo].data)
         return false;
     images[imageNo].len = imgDataLen;
-    images[imageNo].type = ImageType(imgData, imgDataLen);
+    // the whole record is here, no need to ask for more
+    ImageInfo info;
+    probeImage((char*)imgData, imgDataLen, info);
+    images[imageNo].type = info.type;
+    images[imageNo].width = info.width;
+    images[imageNo].height = info.height;
     return true;
 }
 
@@ -827,7 +817,7 @@ void MobiBook::loadImages()
 // recognize)
 ImageData *MobiBook::getImage(size_t imgRecIndex) const
 {
-    if ((imgRecIndex > imagesCount) || (imgRecIndex < 1))
+    if ((imgRecIndex > imagesCount) || (imgRecIndex < 1) || !images)
         return NULL;
    --imgRecIndex;
    if (!images[imgRecIndex].data || (0 == images[imgRecIndex].len))
@@ -839,7 +829,10 @@ ImageData *MobiBook::getImage(size_t imgRecIndex) const
 // except at different resolutions
 ImageData *MobiBook::getCover()
 {
-    if(coverImage >= 0) {
+    if(!images)
+        return NULL;
+    // the EXTH index comes from the file
+    if(coverImage >= 0 && (size_t)coverImage < imagesCount) {
 	return &images[coverImage];
     }
     
@@ -861,6 +854,95 @@ ImageData *MobiBook::getCover()
     return &images[coverImg];
 }
 
+// EXTH records of a type, in file order
+std::pair<std::vector<ExthEntry>::const_iterator, std::vector<ExthEntry>::const_iterator>
+MobiBook::exthRange(uint32 type) const
+{
+    ExthEntry key = { type, 0, 0 };
+    return std::equal_range(exth.begin(), exth.end(), key);
+}
+
+size_t MobiBook::getExthCount(uint32 type) const
+{
+    return exthRange(type).second - exthRange(type).first;
+}
+
+const char *MobiBook::getExth(uint32 type, size_t& len, size_t n) const
+{
+    if (n >= getExthCount(type))
+        return NULL;
+    const ExthEntry& e = exthRange(type).first[n];
+    len = e.len;
+    return firstRecData + e.offset;
+}
+
+std::string MobiBook::getExthString(uint32 type, size_t n) const
+{
+    size_t len;
+    const char *data = getExth(type, len, n);
+    if (!data)
+        return std::string();
+    // some writers include the terminator
+    while (len > 0 && data[len - 1] == '\0')
+        len--;
+    std::string s(data, len);
+    return isLegacyCodePage(exthEncoding) ? toUtf8(exthEncoding, s) : s;
+}
+
+std::string MobiBook::getExthStrings(uint32 type, const char *sep) const
+{
+    std::string all;
+    for (size_t i = 0; i < getExthCount(type); i++) {
+        if (i > 0)
+            all.append(sep);
+        all.append(getExthString(type, i));
+    }
+    return all;
+}
+
+std::vector<std::string> MobiBook::getSubjects() const
+{
+    std::vector<std::string> subjects;
+    for (size_t i = 0; i < getExthCount(EXTH_SUBJECT); i++)
+        subjects.push_back(getExthString(EXTH_SUBJECT, i));
+    return subjects;
+}
+
+// Like getCover, but it reads only the cover record when
+// the images aren't loaded (MOBI_COVER)
+const char *MobiBook::readCover(size_t& len)
+{
+    if (images) {
+        ImageData *id = getCover();
+        if (!id || !id->data)
+            return NULL;
+        len = id->len;
+        return id->data;
+    }
+
+    size_t coverImg = coverImage;
+    if (coverImage < 0) {
+        // the larger of the first two images, by the record sizes
+        size_t size = 0, s;
+        size_t maxImageNo = std::min(imagesCount, (size_t)2);
+        for (size_t i = 0; i < maxImageNo && imageFirstRec + i + 1 < pdbHeader.numRecords; i++) {
+            s = getRecordSize(imageFirstRec + i);
+            if (s > size) {
+                coverImg = i;
+                size = s;
+            }
+        }
+        if (size == 0)
+            return NULL;
+    }
+    if (coverImg >= imagesCount)
+        return NULL;
+    uint8 *data = (uint8*)readRecord(imageFirstRec + coverImg, len);
+    if (!data || 0 == len || IsEofRecord(data, len) || KnownNonImageRec(data, len))
+        return NULL;
+    return (char*)data;
+}
+
 size_t MobiBook::getRecordSize(size_t recNo)
 {
     size_t size = recHeaders[recNo + 1].offset - recHeaders[recNo].offset;
@@ -883,6 +965,8 @@ char *MobiBook::getBufForRecordData(size_t size)
 // read a record and return it's data and size. Return NULL if error
 char* MobiBook::readRecord(size_t recNo, size_t& sizeOut)
 {
+    if (recNo >= pdbHeader.numRecords)
+        return NULL;
     size_t off = recHeaders[recNo].offset;
     DWORD toRead = getRecordSize(recNo);
     sizeOut = toRead;
@@ -931,10 +1015,39 @@ static size_t ExtraDataSize(uint8 *recData, size_t recLen, size_t trailersCount,
 
 // Load a given record of a document into strOut, uncompressing if necessary.
 // Returns false if error.
-bool MobiBook::loadDocRecordIntoBuffer(size_t recNo, std::string& strOut)
+// Append decoded text to out, converted to UTF-8 if needed: filepos
+// values are offsets in the original text, so the offsets of the
+// converted records are kept for textOffset()
+void MobiBook::appendText(const char *text, size_t len, std::string& out)
+{
+    if (!isLegacyCodePage(textEncoding)) {
+        out.append(text, len);
+        return;
+    }
+    textMap.push_back(std::make_pair(rawTextSize, out.size()));
+    rawTextSize += len;
+    appendUtf8(textEncoding, text, len, out);
+}
+
+size_t MobiBook::textOffset(size_t pos) const
+{
+    if (textMap.empty())
+        return pos <= doc.length() ? pos : MAX_SIZE_T;
+    if (pos > rawTextSize)
+        return MAX_SIZE_T;
+    // the last record starting at or before pos, then
+    // one character for each byte of the original text
+    std::vector<std::pair<size_t, size_t> >::const_iterator it =
+        std::upper_bound(textMap.begin(), textMap.end(), std::make_pair(pos, MAX_SIZE_T));
+    --it;
+    return it->second + utf8Skip(doc.data() + it->second, doc.length() - it->second, pos - it->first);
+}
+
+// Decode text record recNo of the text section, appending it to strOut
+bool MobiBook::decodeRecord(size_t recNo, std::string& strOut)
 {
     size_t recSize;
-    char *recData = readRecord(recNo, recSize);
+    char *recData = readRecord(textBase + recNo, recSize);
     if (NULL == recData)
         return false;
     size_t extraSize = ExtraDataSize((uint8*)recData, recSize, trailersCount, multibyte);
@@ -947,7 +1060,7 @@ bool MobiBook::loadDocRecordIntoBuffer(size_t recNo, std::string& strOut)
     if (COMPRESSION_PALM == compressionType) {
         char buf[6000]; // should be enough to decompress any record
         size_t uncompressedSize = PalmdocUncompress((uint8*)recData, recSize, (uint8*)buf, sizeof(buf));
-        if (-1 == uncompressedSize) {
+        if ((size_t)-1 == uncompressedSize) {
             err("PalmDoc decompression failed");
             return false;
         }
@@ -961,7 +1074,7 @@ bool MobiBook::loadDocRecordIntoBuffer(size_t recNo, std::string& strOut)
         if (!huffDic)
             return false;
         size_t uncompressedSize = huffDic->Decompress((uint8*)recData, recSize, (uint8*)buf, sizeof(buf));
-        if (-1 == uncompressedSize) {
+        if ((size_t)-1 == uncompressedSize) {
             err("HuffDic decompression failed");
             return false;
         }
@@ -973,50 +1086,164 @@ bool MobiBook::loadDocRecordIntoBuffer(size_t recNo, std::string& strOut)
     return false;
 }
 
-unsigned int	MobiBook::getLocale() {
+bool MobiBook::loadDocRecordIntoBuffer(size_t recNo, std::string& strOut)
+{
+    if (!isLegacyCodePage(textEncoding))
+        return decodeRecord(recNo, strOut);
+    recText.clear();
+    if (!decodeRecord(recNo, recText))
+        return false;
+    appendText(recText.data(), recText.size(), strOut);
+    return true;
+}
+
+bool MobiBook::readText(size_t start, size_t len, std::string& out)
+{
+    if (start > docUncompressedSize || len > docUncompressedSize - start)
+        return false;
+    if (0 == len)
+        return true;
+    if (textMap.empty() && doc.length() == docUncompressedSize) {
+        out.append(doc, start, len);
+        return true;
+    }
+
+    // records don't always decode to docRecSize bytes (multibyte
+    // overlaps), so their ends are learnt decoding them in order:
+    // i is the first record ending after start, or the first unknown
+    size_t i = std::upper_bound(recEnds.begin(), recEnds.end(), start) - recEnds.begin();
+    size_t base = i ? recEnds[i - 1] : 0;   // offset of recText
+    recText.clear();
+    while (base + recText.length() < start + len) {
+        if (i >= docRecCount || !decodeRecord(i + 1, recText))
+            return false;
+        if (i++ == recEnds.size())
+            recEnds.push_back(base + recText.length());
+        // a record before start, only decoded to find where it ends
+        if (base + recText.length() <= start) {
+            base += recText.length();
+            recText.clear();
+        }
+    }
+    out.append(recText, start - base, len);
+    return true;
+}
+
+bool MobiBook::getFlow(size_t i, std::string& out)
+{
+    if (i >= flows.size())
+        return false;
+    return readText(flows[i].start, flows[i].end - flows[i].start, out);
+}
+
+unsigned int	MobiBook::getLocale() const {
     return locale;
 }
 
+#define FPOSMARK    "filepos="
+#define FPOSLEN     10  // digits of a filepos value
+
+// value of the number at p (atoi-like, up to maxLen chars)
+static uint32 ParseLinkValue(const char *p, const char *end, size_t maxLen)
+{
+    const char *stop = std::min(end, p + maxLen);
+    while ((p < stop) && (' ' == *p))
+        p++;
+    uint32 v = 0;
+    while ((p < stop) && (*p >= '0') && (*p <= '9'))
+        v = v * 10 + (*p++ - '0');
+    return v;
+}
+
+// Collect link targets and image references starting in doc[from..].
+// Unless this is the last call, matches that could be cut by the end
+// of the text decoded so far are left for the next call.
+// Returns where the next call should start.
+size_t MobiBook::indexLinks(size_t from, bool last)
+{
+    size_t fml = strlen(FPOSMARK);
+    size_t limit = doc.length();
+    if (!last)
+        limit = (limit > fml + FPOSLEN) ? limit - fml - FPOSLEN : 0;
+    if (from >= limit)
+        return from;
+
+    const char *text = doc.data(), *end = text + doc.length();
+    size_t pos;
+    for (pos = doc.find(FPOSMARK, from); pos < limit; pos = doc.find(FPOSMARK, pos + fml))
+        anchors.push_back(ParseLinkValue(text + pos + fml, end, FPOSLEN));
+    return limit;
+}
+
+void MobiBook::sortLinks()
+{
+    std::sort(anchors.begin(), anchors.end());
+    anchors.erase(std::unique(anchors.begin(), anchors.end()), anchors.end());
+    linksIndexed = true;
+}
+
+const std::vector<uint32>& MobiBook::getAnchors()
+{
+    if (!linksIndexed) {
+        indexLinks(0, true);
+        sortLinks();
+    }
+    return anchors;
+}
+
 // assumes that ParseHeader() has been called
-bool MobiBook::loadDocument()
+bool MobiBook::loadDocument(unsigned int flags)
 {
     assert(docUncompressedSize > 0);
+    if (flags & (MOBI_NO_TEXT | MOBI_COVER))
+        return true;
 
-    //doc = new str::Str<char>(docUncompressedSize);
+    doc.reserve(docUncompressedSize);
+    size_t scanned = 0;
     for (size_t i = 1; i <= docRecCount; i++) {
         if (!loadDocRecordIntoBuffer(i, doc))
             return false;
+        recEnds.push_back(textMap.empty() ? doc.length() : rawTextSize);
+        if (flags & MOBI_INDEX_LINKS)
+            scanned = indexLinks(scanned, false);
     }
-    assert(docUncompressedSize == doc.length());
-    /*
-    if (textEncoding != CP_UTF8) {
-        char *docUtf8 = str::ToMultiByte(doc->Get(), textEncoding, CP_UTF8);
-        if (docUtf8) {
-            doc->Reset();
-            doc->AppendAndFree(docUtf8);
-        }
-    }*/
+    if (flags & MOBI_INDEX_LINKS) {
+        indexLinks(scanned, true);
+        sortLinks();
+    }
+    assert(docUncompressedSize == (textMap.empty() ? doc.length() : rawTextSize));
     return true;
 }
 
-MobiBook *MobiBook::createFromFile(const char *fileName)
+MobiBook *MobiBook::createFromFile(const char *fileName, unsigned int flags,
+        unsigned int huffMaxDepth, size_t huffMaxWork)
 {
-    FILE * fh = fopen(fileName, "rb");
-    if (fh == NULL)
-        return NULL;
     MobiBook *mb = new MobiBook();
-    mb->fileName = strdup(fileName);
-    mb->fileHandle = fh;
-
-    if (mb->parseHeader()) {
-	if (mb->loadDocument()) 
-		return mb;
-    }
-
+    if (mb->reopen(fileName, flags, huffMaxDepth, huffMaxWork))
+        return mb;
     delete mb;
     return NULL;
 }
 
+bool MobiBook::reopen(const char *fileName, unsigned int flags,
+        unsigned int huffMaxDepth, size_t huffMaxWork)
+{
+    reset();
+    // limits for untrusted books
+    this->huffMaxDepth = huffMaxDepth ? huffMaxDepth : kHuffMaxDepth;
+    this->huffMaxWork = huffMaxWork ? huffMaxWork : kHuffMaxWork;
+    FILE * fh = fopen(fileName, "rb");
+    if (fh == NULL)
+        return false;
+    this->fileName = arena.strdup(fileName);
+    fileHandle = fh;
+
+    if (parseHeader(flags) && loadDocument(flags))
+        return true;
+    reset();
+    return false;
+}
+
 Dumper * MobiBook::getDumper(const char * outdir) {
 	return new MobiDumper(this, outdir);
     }
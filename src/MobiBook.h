@@ -18,9 +18,31 @@
 #include "Ebook.h"
 
 #include <string>
+#include <vector>
+#include <memory>
 
+class HuffDicTables;
 class HuffDicDecompressor;
 
+// createFromFile flags
+#define MOBI_INDEX_LINKS	0x01	// index link targets while decoding
+#define MOBI_KF8		0x02	// use the KF8 section of combination files
+#define MOBI_NO_TEXT		0x04	// don't decode the text (see readText)
+#define MOBI_COVER		0x08	// only the headers: no text, index or images (see readCover)
+
+// EXTH record types
+#define EXTH_AUTHOR		100
+#define EXTH_PUBLISHER		101
+#define EXTH_DESCRIPTION	103
+#define EXTH_ISBN		104
+#define EXTH_SUBJECT		105
+#define EXTH_DATE		106
+#define EXTH_ASIN		113
+#define EXTH_KF8_BOUNDARY	121
+#define EXTH_COVER		201
+#define EXTH_TITLE		503
+#define EXTH_LANGUAGE		524
+
 // http://en.wikipedia.org/wiki/PDB_(Palm_OS)
 #define kDBNameLength    32
 #define kPdbHeaderLen    78
@@ -68,10 +90,33 @@ STATIC_ASSERT(kPdbRecordHeaderLen == sizeof(PdbRecordHeader), validPdbRecordHead
 
 #define kMaxRecordSize 64*1024
 
+// a flow of KF8 text (from the FDST record): the html, then css, svg...
+struct Kf8Flow {
+    uint32	start, end;
+};
+
+// an entry of the NCX index (the table of contents)
+struct MobiTocEntry {
+    std::string	label;
+    uint32	pos;	// text offset, as in filepos links
+    uint32	len;
+    int		depth;
+    int		parent;	// index of the parent entry, -1 if none
+};
+
+// an EXTH record, its data is in record 0 (firstRecData) at offset
+struct ExthEntry {
+    uint32	type;
+    uint32	offset;
+    uint32	len;
+    bool operator<(const ExthEntry& o) const { return type < o.type; }
+};
+
 struct ImageData {
     char *      data;
     size_t      len;
-    char *	type;
+    const char *type;	// file extension (static, don't free)
+    uint32      width, height;	// 0 if unknown
 };
 
 class MobiBook : public Ebook
@@ -84,14 +129,31 @@ class MobiBook : public Ebook
     size_t              docRecCount;
     int                 compressionType;
     size_t              docUncompressedSize;
+    size_t              docRecSize;
     int                 textEncoding;
 
+    // records of the text section start from textBase: it's 0, or
+    // the KF8 section of a combination file (with MOBI_KF8)
+    size_t              textBase;
+    bool                kf8, kf8Text;
+    size_t              kf8Base;
+    std::vector<Kf8Flow> flows;
+
+    // NCX index record, relative to textBase (0xffffffff if none)
+    uint32              ncxRec;
+    std::vector<MobiTocEntry> toc;
+
     bool                multibyte;
     size_t              trailersCount;
     size_t              imageFirstRec; // 0 if no images
     int32_t		coverImage;
     unsigned int	locale;
 
+    // EXTH records sorted by type (stable, so in file order
+    // within a type), and the encoding of their strings
+    std::vector<ExthEntry> exth;
+    int                 exthEncoding;
+
     // we use bufStatic if record fits in it, bufDynamic otherwise
     char                bufStatic[kMaxRecordSize];
     char *              bufDynamic;
@@ -99,17 +161,44 @@ class MobiBook : public Ebook
 
     ImageData *         images;
     std::string		doc;
+    // text in a legacy code page is converted to UTF-8 while loading:
+    // offset of each record in the original text and in doc
+    std::vector<std::pair<size_t, size_t> >	textMap;
+    size_t		rawTextSize;
+    std::string		recText;
+    // end of each text record decoded so far, in the original text
+    std::vector<size_t>	recEnds;
+
+    // sorted, unique filepos targets
+    bool		linksIndexed;
+    std::vector<uint32>	anchors;
 
+    // the tables can be shared, the decoder state can't.
+    // spareTables are the last book's, kept for reopen()
+    std::shared_ptr<HuffDicTables> huffTables, spareTables;
     HuffDicDecompressor *huffDic;
+    uint32		huffMaxDepth;
+    size_t		huffMaxWork;
 
     MobiBook();
+    void	reset();
 
-    bool	parseHeader();
-    bool	loadDocument();
+    bool	parseHeader(unsigned int flags);
+    bool	parseKf8Header(uint32& huffFirst, uint32& huffCount);
+    bool	loadFlows(size_t fdstRec, size_t fdstCount);
+    bool	loadToc();
+    std::pair<std::vector<ExthEntry>::const_iterator, std::vector<ExthEntry>::const_iterator>
+		exthRange(uint32 type) const;
+    bool	loadDocument(unsigned int flags);
+    size_t	indexLinks(size_t from, bool last);
+    void	sortLinks();
     char *	getBufForRecordData(size_t size);
     size_t	getRecordSize(size_t recNo);
     char*	readRecord(size_t recNo, size_t& sizeOut);
+    bool	decodeRecord(size_t recNo, std::string& out);
     bool	loadDocRecordIntoBuffer(size_t recNo, std::string& strOut);
+    void	appendText(const char *text, size_t len, std::string& out);
+    size_t	countImageRecords();
     void	loadImages();
     bool	loadImage(size_t imageNo);
 
@@ -119,15 +208,63 @@ public:
 
     ~MobiBook();
 
-    std::string&	getText() { return doc; }
+    const std::string&	getText() const { return doc; }
     size_t		getTextSize() const { return doc.length(); }
-    unsigned int	getLocale();
+    // offset in getText() of an offset in the original text (as
+    // in filepos links), MAX_SIZE_T if past the end
+    size_t		textOffset(size_t pos) const;
+    // Append len bytes of the text from start (in its original encoding)
+    // decoding only the records they span: works with MOBI_NO_TEXT too
+    bool		readText(size_t start, size_t len, std::string& out);
+
+    // KF8 (azw3) content: a KF8 only book, or a combination file
+    bool		hasKF8() const { return kf8; }
+    // record 0 of the KF8 section (0 for KF8 only books)
+    size_t		getKF8Base() const { return kf8Base; }
+    // the text is the KF8 one: flows and readText refer to it
+    bool		isKF8Text() const { return kf8Text; }
+    const std::vector<Kf8Flow>&	getFlows() const { return flows; }
+    bool		getFlow(size_t i, std::string& out);
+    // the NCX entries, in index order: read with the headers, so
+    // they're available with MOBI_NO_TEXT too (empty if no NCX)
+    const std::vector<MobiTocEntry>&	getToc() const { return toc; }
+    // EXTH records of a type: the n-th one, in place (NULL if
+    // missing), or as an UTF-8 string ("" if missing)
+    size_t		getExthCount(uint32 type) const;
+    const char *	getExth(uint32 type, size_t& len, size_t n = 0) const;
+    std::string		getExthString(uint32 type, size_t n = 0) const;
+    // all the records of a type, separated by sep
+    std::string		getExthStrings(uint32 type, const char *sep) const;
+    std::string		getIsbn() const { return getExthString(EXTH_ISBN); }
+    std::string		getLanguage() const { return getExthString(EXTH_LANGUAGE); }
+    std::vector<std::string>	getSubjects() const;
+    std::string		getPublishDate() const { return getExthString(EXTH_DATE); }
+    std::string		getAsin() const { return getExthString(EXTH_ASIN); }
+    std::string		getDescription() const { return getExthString(EXTH_DESCRIPTION); }
+    unsigned int	getLocale() const;
     ImageData *		getCover();
-    int32_t		getCoverIndex() { return coverImage; }
+    // the cover image data, read from its record if images
+    // weren't loaded: valid up to the next read (NULL if none)
+    const char *	readCover(size_t& len);
+    int32_t		getCoverIndex() const { return coverImage; }
     ImageData *		getImage(size_t imgRecIndex) const;
-    char *		getFileName() const { return fileName; }
+    const char *	getFileName() const { return fileName; }
+    // filepos link targets, i.e. the text offsets that are linked to
+    const std::vector<uint32>&	getAnchors();
 
-    static MobiBook *	createFromFile(const char *fileName);
+    // huffMaxDepth and huffMaxWork are the HuffDic limits for this book:
+    // nesting of the dictionary entries, and codes decoded for each
+    // text record (0 for the defaults)
+    static MobiBook *	createFromFile(const char *fileName, unsigned int flags = 0,
+			    unsigned int huffMaxDepth = 0, size_t huffMaxWork = 0);
+    // Open another book with this object, recycling its record buffers,
+    // arena, HuffDic tables and decoder (for batch jobs: one object per
+    // thread). On failure the book is empty, and can be reopened again
+    bool		reopen(const char *fileName, unsigned int flags = 0,
+			    unsigned int huffMaxDepth = 0, size_t huffMaxWork = 0);
+    // HuffDic tables of the book (empty if not compressed so), to decode
+    // its records from other threads with their own HuffDicDecompressor
+    std::shared_ptr<const HuffDicTables>	getHuffDicTables() const { return huffTables; }
     Dumper *		getDumper(const char * outdir);
 };
 
@@ -8,12 +8,15 @@
  */
 
 #include "MobiDumper.h"
-#include "JsonObj.h"
 #include "Xml.h"
 #include <iostream>
+#include <memory>
 #include <stdio.h>
 #include <algorithm>
 #include <string>
+#include <string.h>
+#include <map>
+#include <set>
 
 using std::string;
 using std::vector;
@@ -21,58 +24,141 @@ using std::vector;
 #define FPOSLEN 10
 
 MobiDumper::~MobiDumper() {
+    // pending writes point into parts
+    flush();
 }
 
-void MobiDumper::dumpMetadata() {
-    JsonObj meta;
+// keys in alphabetical order, as info.json always had them
+void MobiDumper::writeInfo(MetaWriter & meta) {
+    // the EXTH fields are there only if present
+    auto exth = [this, &meta](uint32 type, const char * key) {
+	if(mobi->getExthCount(type)) meta.add(key, mobi->getExthString(type));
+    };
+    Toc toc = buildToc();
+    char posstr[12];
+
+    exth(EXTH_ASIN, "asin");
     meta.add("author", book->getAuthor());
-    meta.add("title", book->getTitle());
+    int32_t cover = mobi->getCoverIndex();
+    if(cover > 0 && (size_t)cover < imgNames.size())
+        meta.add("cover", imgNames[cover]);
+    exth(EXTH_DATE, "date");
+    exth(EXTH_DESCRIPTION, "description");
+    exth(EXTH_ISBN, "isbn");
+    meta.add("items", txtFileNames);
+    exth(EXTH_LANGUAGE, "language");
+
+    // every NCX entry, in book order, with its nesting
+    if(!mobi->getToc().empty()) {
+	meta.key("ncx").beginArray();
+	for(Toc::iterator it = toc.begin(); it != toc.end(); ++it) {
+	    snprintf(posstr, sizeof(posstr), "%d", it->pos);
+	    meta.beginObject().add("path", it->href);
+	    meta.add("name", it->name);
+	    meta.add("pos", posstr);
+	    meta.add("depth", it->depth);
+	    if(it->parent >= 0) meta.add("parent", it->parent);
+	    meta.endObject();
+	}
+	meta.endArray();
+    }
+
     meta.add("publisher", book->getPublisher());
-    if(mobi->getCoverIndex() > 0)
-        meta.add("cover", imgNames[mobi->getCoverIndex()]);
-    vector<JsonObj> res;
-    for(int i = 0; i < imgNames.size(); ++i) {
-	JsonObj ares;
-	ares.add("path", imgNames[i]);
-	res.push_back(ares);
+    meta.key("res").beginArray();
+    for(size_t i = 0; i < imgNames.size(); ++i) {
+	meta.beginObject().add("path", imgNames[i]);
+	if(const string * orig = sameAs(imgNames[i])) meta.add("same", *orig);
+	const ImageData * id = mobi->getImage(i+1);
+	if(id && id->width)
+	    meta.add("width", id->width).add("height", id->height);
+	meta.endObject();
     }
-    meta.add("items", txtFileNames);
-    meta.add("res", res);
+    meta.endArray();
+    if(mobi->getExthCount(EXTH_SUBJECT))
+	meta.add("subjects", mobi->getSubjects());
+    meta.add("title", book->getTitle());
 
-    JsonObj toc = buildToc();
-    if(!toc.empty()) meta.add("toc", toc);
-    
-    write("info.json", meta.json());
+    if(!toc.empty()) {
+	// by href: the first item of a part that starts several
+	std::map<string, const TocItem *> byHref;
+	for(Toc::iterator it = toc.begin(); it != toc.end(); ++it)
+	    byHref.insert(std::make_pair(it->href, &(*it)));
+	meta.key("toc").beginObject();
+	for(std::map<string, const TocItem *>::iterator it = byHref.begin(); it != byHref.end(); ++it) {
+	    snprintf(posstr, sizeof(posstr), "%d", it->second->pos);
+	    meta.key(it->first).beginObject();
+	    meta.add("name", it->second->name);
+	    meta.add("pos", posstr);
+	    meta.endObject();
+	}
+	meta.endObject();
+    }
 }
 
-string MobiDumper::fixLinks(string src) {
-    char fbuf[24];
+#define FPOSMARK	"filepos="
+#define FPOSHREF	"href=\"text_"
+#define FPOSEXT		".html\""
+#define RECMARK		"recindex=\""
+#define RECLEN		5
+#define PAGEBREAK	"<mbp:pagebreak/>"
+#define LEN(s)		(sizeof(s)-1)
 
-    // Step 1. fix a[@href]    
-    string fmark = "filepos=", href="href=\"text_";
-    size_t fml = fmark.length(), hl = href.length();
-    string::size_type pos = src.find(fmark);
-    while(pos!=string::npos) {
-	src.replace(pos, fml, href);
-	src.insert(pos+hl+FPOSLEN,".html\"");
-	pos = src.find(fmark, pos+hl+FPOSLEN);
-    }
+static bool startsWith(const char * p, const char * end, const char * mark, size_t ml) {
+    return (size_t)(end - p) >= ml && !memcmp(p, mark, ml);
+}
 
+// Append text[0..len) to out, in a single pass over the markup:
+// filepos links become links to the text parts, recindex images
+// point to the image files and mobipocket's page breaks are dropped
+void MobiDumper::fixLinks(const char * text, size_t len, string & out) {
+    const char * p = text, * end = text + len, * run, * gt;
 
-    // Step 2. fix img[@src]
-    for(int i = 0; i < imgNames.size(); ++i) {
-	sprintf(fbuf, "recindex=\"%05d\"", i+1);
-	string f1 = string(fbuf);
-	string r1 = "src=\"";
-	r1.append(imgNames[i]);
-	r1.append("\"");
-	replaceAll(src, f1, r1);
-    }
+    while(p < end) {
+	// text up to the next tag
+	const char * lt = (const char *)memchr(p, '<', end - p);
+	if(!lt) {
+	    out.append(p, end - p);
+	    break;
+	}
+	out.append(p, lt - p);
+	gt = (const char *)memchr(lt, '>', end - lt);
+	gt = gt ? gt + 1 : end;
+
+	// (ok, page breaks are not related to links, but they fit well here)
+	if(gt - lt == LEN(PAGEBREAK) && !memcmp(lt, PAGEBREAK, LEN(PAGEBREAK))) {
+	    p = gt;
+	    continue;
+	}
 
-    // Step 3. remove mobipocket's page break
-    // (ok, it's not related to links, but it fits well here)
-    replaceAll(src, "<mbp:pagebreak/>", "");
-    return src;
+	// attributes of the tag
+	run = p = lt;
+	while(p < gt) {
+	    if(*p == 'f' && startsWith(p, end, FPOSMARK, LEN(FPOSMARK))) {
+		out.append(run, p - run);
+		p += LEN(FPOSMARK);
+		size_t n = std::min((size_t)(end - p), (size_t)FPOSLEN);
+		out.append(FPOSHREF).append(p, n).append(FPOSEXT);
+		p += n;
+		run = p;
+		if(p >= gt) {
+		    gt = (const char *)memchr(p, '>', end - p);
+		    gt = gt ? gt + 1 : end;
+		}
+	    } else if(*p == 'r' && startsWith(p, end, RECMARK, LEN(RECMARK))) {
+		const char * d = p + LEN(RECMARK);
+		size_t rec = 0, nd = 0;
+		while(d + nd < end && nd < RECLEN && d[nd] >= '0' && d[nd] <= '9')
+		    rec = rec*10 + (d[nd++] - '0');
+		if(nd == RECLEN && d + nd < end && d[nd] == '"' && rec >= 1 && rec <= imgSrc.size()) {
+		    out.append(run, p - run);
+		    out.append(imgSrc[rec-1]);
+		    p = d + nd + 1;
+		    run = p;
+		} else ++p;
+	    } else ++p;
+	}
+	out.append(run, p - run);
+    }
 }
 
 #define CS_META "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\" />"
@@ -81,35 +167,65 @@ string MobiDumper::fixLinks(string src) {
 
 void MobiDumper::dumpText() {
     char fbuf[24];
-    string text = mobi->getText(), 
-	    part;
+    const string & text = mobi->getText();
+    size_t end = text.length(), count = 1, part;
+
+    for( vector<int>::iterator ip = filepos.begin(); ip != filepos.end(); ip++)
+	if(*ip >= 0 && mobi->textOffset(*ip) <= end) ++count;
+    txtFileNames.resize(count);
+    parts.resize(count);
 
+    // filepos is sorted in reverse order: each part runs
+    // from its split point up to the previous one
+    part = count;
     for( vector<int>::iterator ip = filepos.begin(); ip != filepos.end(); ip++) {
-	//split at *ip
-	part = fixLinks(text.substr(*ip));
-	text = text.substr(0,*ip);
-	//write part
+	if(*ip < 0) continue;
+	// filepos values are offsets in the original encoding
+	size_t start = mobi->textOffset(*ip);
+	if(start > end) continue;
+	--part;
 	sprintf(fbuf, "text_%010d.html", *ip);
-	txtFileNames.push_back(fbuf);
-	write(fbuf, HTML_PROLOG+part+HTML_EPILOG);
+	txtFileNames[part] = fbuf;
+	submit([this, &text, start, end, part]() {
+	    string & content = parts[part];
+	    content.reserve(sizeof(HTML_PROLOG) + (end-start) + sizeof(HTML_EPILOG));
+	    content.append(HTML_PROLOG);
+	    fixLinks(text.data()+start, end-start, content);
+	    content.append(HTML_EPILOG);
+	    write(txtFileNames[part].c_str(), content.data(), content.size());
+	});
+	end = start;
     }
 
-    text = fixLinks(text);
-    size_t bpos = text.find("</head");
-    if(bpos != string::npos) text.insert(bpos, CS_META);
-    write("text.html", text+HTML_EPILOG);
-    txtFileNames.push_back("text.html");
-    std::reverse(txtFileNames.begin(), txtFileNames.end());
+    txtFileNames[0] = "text.html";
+    submit([this, &text, end]() {
+	string & head = parts[0];
+	head.reserve(end + sizeof(CS_META) + sizeof(HTML_EPILOG));
+	fixLinks(text.data(), end, head);
+	size_t bpos = head.find("</head");
+	if(bpos != string::npos) head.insert(bpos, CS_META);
+	head.append(HTML_EPILOG);
+	write(txtFileNames[0].c_str(), head.data(), head.size());
+    });
 }
 
 void MobiDumper::dumpResources() {
 	ImageData * id;
 	
-	for(int i = 1; i <= mobi->imagesCount; ++i) {
+	for(size_t i = 1; i <= mobi->imagesCount; ++i) {
 	    id = mobi->getImage(i);
 	    if(id==NULL) break;
+
+	    // the same picture is often stored more than once
+	    const string * orig = original(imgNames[i-1], i, fnv1a(id->data, id->len), id->len,
+		    [this, id](int first) {
+			return !memcmp(mobi->getImage(first)->data, id->data, id->len);
+		    });
+	    if(orig && link(imgNames[i-1].c_str(), *orig)) continue;
 	    
-	    write(imgNames[i-1].c_str(), id->data, id->len);
+	    submit([this, i, id]() {
+		write(imgNames[i-1].c_str(), id->data, id->len);
+	    });
 	}
 }
 
@@ -117,61 +233,80 @@ void MobiDumper::scanImages() {
 	ImageData * id;
 	char fname[PATHLEN];
 	
-	for(int i = 1; i <= mobi->imagesCount; ++i) {
+	for(size_t i = 1; i <= mobi->imagesCount; ++i) {
 	    id = mobi->getImage(i);
 	    if(id==NULL) break;
-	    sprintf(fname, "img_%03d%s", i, id->type);
+	    sprintf(fname, "img_%03d%s", (int)i, id->type);
 	    imgNames.push_back(string(fname));
+	    imgSrc.push_back("src=\"" + imgNames.back() + "\"");
 	}
 }
 
 void MobiDumper::scanLinks() {
-    string txt = mobi->getText();
-    string fmark = "filepos=";
-    size_t fml = fmark.length();
-    int val;
-    
-    // find all filepos marks (avoiding duplicates)
-    string::size_type pos = txt.find(fmark);
-    while(pos!=string::npos) {
-	val = atoi(txt.substr(pos+fml, FPOSLEN).c_str());
-	if( std::find(filepos.begin(), filepos.end(), val) == filepos.end())
-		filepos.push_back(val);
-	pos = txt.find(fmark, pos+fml);
-    }
-    
-    // sort them in reverse order
+    // split points, in reverse order: link targets and NCX entries
+    const vector<uint32> & anchors = mobi->getAnchors();
+    filepos.assign(anchors.rbegin(), anchors.rend());
+    const vector<MobiTocEntry> & ncx = mobi->getToc();
+    if(ncx.empty()) return;
+    for(vector<MobiTocEntry>::const_iterator it = ncx.begin(); it != ncx.end(); ++it)
+	filepos.push_back(it->pos);
     std::sort(filepos.begin(), filepos.end(), std::greater<int>());
+    filepos.erase(std::unique(filepos.begin(), filepos.end()), filepos.end());
 }
 
-JsonObj MobiDumper::buildToc() {
-    JsonObj toc;
-    char posstr[10];
+MobiDumper::Toc MobiDumper::buildToc() {
+    Toc toc;
     //dumpText should be called first!
     if(txtFileNames.size()==0) return toc;
 
+    std::map<string, int> partIndex;
+    for(size_t i = 0; i < txtFileNames.size(); ++i)
+	partIndex[txtFileNames[i]] = i;
+
+    //the NCX index, if any, is the toc (every entry starts a part):
+    //one item for each entry, a parent and its first child share a part
+    const vector<MobiTocEntry> & ncx = mobi->getToc();
+    if(!ncx.empty()) {
+	char fbuf[24];
+	toc.resize(ncx.size());
+	for(size_t i = 0; i < ncx.size(); ++i) {
+	    TocItem & item = toc[i];
+	    sprintf(fbuf, "text_%010d.html", ncx[i].pos);
+	    item.href = fbuf;
+	    std::map<string, int>::iterator pi = partIndex.find(fbuf);
+	    item.pos = (pi == partIndex.end()) ? -1 : pi->second;
+	    item.name = ncx[i].label;
+	    item.depth = ncx[i].depth;
+	    item.parent = ncx[i].parent;
+	}
+	return toc;
+    }
+
     //look for toc reference in the first part
-    Xml ref(read(txtFileNames[0]));
+    Xml ref(parts[0].data(), parts[0].size());
     Xpath rx = ref.xpath(NULL);
-    string href = rx.get("//reference[@type='toc']/@href");
-    if(href.empty()) return toc;
-    //open toc file and process 'a' elements
-    Xml tocx(read(href));
+    string href = rx.get("//" + ref.defaultPrefix() + "reference[@type='toc']/@href");
+    std::map<string, int>::iterator ti = partIndex.find(href);
+    if(ti == partIndex.end()) return toc;
+    //parse toc part and process 'a' elements
+    const string & tocPart = parts[ti->second];
+    Xml tocx(tocPart.data(), tocPart.size());
     Xpath tx = tocx.xpath(NULL);
-    vector<string> links = tx.query("//a[@href]/@href");
-    int pos;
+    string a = "//" + tocx.defaultPrefix() + "a";
+    vector<string> links = tx.query(a + "[@href]/@href");
+    varlist vars;
+    std::set<string> seen;
     for(vector<string>::iterator it = links.begin(); it != links.end(); ++it) {
-	JsonObj item;
-	for(pos = txtFileNames.size()-1; pos >= 0; --pos) {
-	    if(txtFileNames[pos]==*it) break;
-	}
-	snprintf(posstr, 9, "%d", pos);
-	item.add("pos", posstr);
-	string q("//a[@href='");
-	q.append(*it).append("']");
-	item.add("name", tx.get(q));
-	//item.add("name", *it); //should be <a>.value
-	toc.add(*it, item);
+	if(!seen.insert(*it).second) continue;
+	TocItem item;
+	item.href = *it;
+	ti = partIndex.find(*it);
+	item.pos = (ti == partIndex.end()) ? -1 : ti->second;
+	vars["href"] = *it;
+	item.name = tx.get(a + "[@href=$href]", &vars);
+	item.depth = 0;
+	item.parent = -1;
+	toc.push_back(item);
     }
     
     return toc;
@@ -10,8 +10,8 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include "MobiBook.h"
-#include "JsonObj.h"
 
 class MobiDumper : public Dumper {
 public:
@@ -23,19 +23,34 @@ public:
 
     void dumpResources();
     void dumpText();
-    void dumpMetadata();
 
     virtual ~MobiDumper();
+
+protected:
+    void writeInfo(MetaWriter & meta);
+
 private:
     MobiBook * mobi;
     std::vector<std::string> imgNames, txtFileNames;
+    // src="..." replacement for each recindex
+    std::vector<std::string> imgSrc;
+    // content of the text parts, as written
+    std::vector<std::string> parts;
     std::vector<int> filepos;
 
 
-    std::string fixLinks(std::string );
+    void fixLinks(const char * text, size_t len, std::string & out);
     void scanImages();
     void scanLinks();
-    JsonObj buildToc();
+    struct TocItem {
+	std::string href;
+	std::string name;
+	int pos;	// index of the text part
+	int depth;
+	int parent;	// index of the parent item, -1 if none
+    };
+    typedef std::vector<TocItem> Toc;	// in book order
+    Toc buildToc();
 };
 
 #endif	/* MOBIHTMLHELPER_H */
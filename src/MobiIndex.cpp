@@ -0,0 +1,203 @@
+/* 
+ * MobiIndex
+ * Reader for the INDX records of mobi books (NCX and other indices)
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "MobiIndex.h"
+#include <iostream>
+#include <string.h>
+
+#define err(msg) std::cerr << "[ERROR] " << msg << std::endl;
+
+// INDX header fields
+#define INDX_LEN	4
+#define INDX_START	20	// IDXT offset
+#define INDX_COUNT	24	// index records (primary) or entries
+#define INDX_CODE	28	// text encoding
+#define INDX_NCNCX	52	// CNCX records
+#define INDX_MINLEN	56
+
+// CNCX strings are addressed by record * 0x10000 + offset
+#define CNCX_RECBITS	16
+
+static uint32_t be32(const uint8_t * d) {
+    return (uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | (uint32_t)d[2] << 8 | d[3];
+}
+
+static uint16_t be16(const uint8_t * d) {
+    return d[0] << 8 | d[1];
+}
+
+// forward variable width integer: 7 bits per byte, the last byte has
+// the high bit set. Returns the bytes used, 0 if truncated
+static size_t vwi(const uint8_t * p, const uint8_t * end, uint32_t & v) {
+    const uint8_t * start = p;
+    v = 0;
+    while(p < end) {
+	v = v << 7 | (*p & 0x7f);
+	if(*p++ & 0x80) return p - start;
+    }
+    return 0;
+}
+
+static int bitCount(int v) {
+    int n = 0;
+    for(; v; v >>= 1) n += v & 1;
+    return n;
+}
+
+uint32_t MobiIndex::Entry::value(int tag, uint32_t def) const {
+    std::map<int, std::vector<uint32_t> >::const_iterator it = tags.find(tag);
+    return (it == tags.end() || it->second.empty()) ? def : it->second[0];
+}
+
+bool MobiIndex::parse(RecordReader read) {
+    std::string rec;
+    entries.clear();
+    tagx.clear();
+    cncxRecs.clear();
+
+    if(!read(0, rec) || rec.size() < INDX_MINLEN || rec.compare(0, 4, "INDX")) {
+	err("invalid INDX record");
+	return false;
+    }
+    const uint8_t * d = (const uint8_t *)rec.data();
+    uint32_t hdrLen = be32(d + INDX_LEN), count = be32(d + INDX_COUNT),
+	    ncncx = be32(d + INDX_NCNCX);
+    encoding = be32(d + INDX_CODE);
+
+    // TAGX: the tags of the entries, and their control bytes
+    // (the lengths come from the file: no sums, they could wrap)
+    if(hdrLen > rec.size() || rec.size() - hdrLen < 12 || rec.compare(hdrLen, 4, "TAGX")) {
+	err("missing TAGX section");
+	return false;
+    }
+    uint32_t tagxLen = be32(d + hdrLen + 4);
+    controlBytes = be32(d + hdrLen + 8);
+    if(tagxLen < 12 || tagxLen > rec.size() - hdrLen) {
+	err("invalid TAGX section");
+	return false;
+    }
+    for(uint32_t i = 12; i + 4 <= tagxLen; i += 4) {
+	const uint8_t * t = d + hdrLen + i;
+	Tag tag = { t[0], t[1], t[2], t[3] };
+	tagx.push_back(tag);
+    }
+
+    for(uint32_t i = 1; i <= count; ++i) {
+	if(!read(i, rec) || !parseRecord(rec))
+	    return false;
+    }
+    for(uint32_t i = 0; i < ncncx; ++i) {
+	cncxRecs.push_back(std::string());
+	if(!read(count + 1 + i, cncxRecs.back()))
+	    return false;
+    }
+    return true;
+}
+
+bool MobiIndex::parseRecord(const std::string & rec) {
+    const uint8_t * d = (const uint8_t *)rec.data();
+    if(rec.size() < INDX_MINLEN || rec.compare(0, 4, "INDX")) {
+	err("invalid INDX record");
+	return false;
+    }
+    uint32_t idxt = be32(d + INDX_START), count = be32(d + INDX_COUNT);
+    if(idxt > rec.size() || rec.size() - idxt < 4 || rec.compare(idxt, 4, "IDXT")
+	    || count > (rec.size() - idxt - 4) / 2) {
+	err("invalid IDXT section");
+	return false;
+    }
+    // each entry runs up to the next one, the last one up to IDXT
+    for(uint32_t i = 0; i < count; ++i) {
+	uint32_t start = be16(d + idxt + 4 + i * 2);
+	uint32_t end = (i + 1 < count) ? be16(d + idxt + 4 + (i + 1) * 2) : idxt;
+	if(start >= end || end > idxt || !parseEntry(d + start, d + end)) {
+	    err("invalid index entry");
+	    return false;
+	}
+    }
+    return true;
+}
+
+bool MobiIndex::parseEntry(const uint8_t * p, const uint8_t * end) {
+    Entry e;
+    size_t identLen = *p++;
+    if(identLen + controlBytes > (size_t)(end - p))
+	return false;
+    e.ident.assign((const char *)p, identLen);
+    p += identLen;
+    const uint8_t * control = p;
+    p += controlBytes;
+
+    // how many values (or bytes of values) each tag has
+    struct Count { int tag, values, bytes, perEntry; };
+    std::vector<Count> counts;
+    size_t ci = 0;
+    for(size_t i = 0; i < tagx.size(); ++i) {
+	const Tag & t = tagx[i];
+	if(t.endFlag == 1) {
+	    ++ci;
+	    continue;
+	}
+	if(ci >= controlBytes || !t.mask)
+	    return false;
+	int v = control[ci] & t.mask;
+	if(!v) continue;
+	Count c = { t.tag, 0, 0, t.valuesPerEntry };
+	if(v == t.mask && bitCount(t.mask) > 1) {
+	    // the size in bytes of the values follows
+	    uint32_t n;
+	    size_t used = vwi(p, end, n);
+	    if(!used) return false;
+	    p += used;
+	    c.bytes = n;
+	} else {
+	    int mask = t.mask;
+	    while(!(mask & 1)) {
+		mask >>= 1;
+		v >>= 1;
+	    }
+	    c.values = v * t.valuesPerEntry;
+	}
+	counts.push_back(c);
+    }
+
+    for(size_t i = 0; i < counts.size(); ++i) {
+	std::vector<uint32_t> & values = e.tags[counts[i].tag];
+	uint32_t v;
+	if(counts[i].bytes) {
+	    for(int used = 0; used < counts[i].bytes; ) {
+		size_t n = vwi(p, end, v);
+		if(!n) return false;
+		p += n;
+		used += n;
+		values.push_back(v);
+	    }
+	} else {
+	    for(int j = 0; j < counts[i].values; ++j) {
+		size_t n = vwi(p, end, v);
+		if(!n) return false;
+		p += n;
+		values.push_back(v);
+	    }
+	}
+    }
+    entries.push_back(e);
+    return true;
+}
+
+std::string MobiIndex::cncx(uint32_t offset) const {
+    size_t recNo = offset >> CNCX_RECBITS, pos = offset & ((1 << CNCX_RECBITS) - 1);
+    if(recNo >= cncxRecs.size()) return "";
+    const std::string & rec = cncxRecs[recNo];
+    const uint8_t * d = (const uint8_t *)rec.data(), * end = d + rec.size();
+    if(pos >= rec.size()) return "";
+    uint32_t len;
+    size_t used = vwi(d + pos, end, len);
+    if(!used || len > rec.size() - pos - used) return "";
+    return rec.substr(pos + used, len);
+}
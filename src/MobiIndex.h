@@ -0,0 +1,57 @@
+/* 
+ * MobiIndex
+ * Reader for the INDX records of mobi books (NCX and other indices)
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef MOBIINDEX_H
+#define	MOBIINDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <stdint.h>
+
+/*
+ * An index is a primary INDX record (with the TAGX table describing
+ * the entries), the INDX records with the entries, and the CNCX
+ * records holding their strings.
+ */
+class MobiIndex {
+public:
+    struct Entry {
+	std::string ident;
+	std::map<int, std::vector<uint32_t> > tags;
+
+	// first value of tag, or def if missing
+	uint32_t value(int tag, uint32_t def) const;
+    };
+
+    // fetches record n (relative to the primary record) into out
+    typedef std::function<bool(size_t n, std::string & out)> RecordReader;
+
+    bool parse(RecordReader read);
+
+    // the string at a CNCX offset (a label tag value)
+    std::string cncx(uint32_t offset) const;
+
+    std::vector<Entry> entries;
+    uint32_t encoding;
+
+private:
+    struct Tag {
+	int tag, valuesPerEntry, mask, endFlag;
+    };
+
+    bool parseRecord(const std::string & rec);
+    bool parseEntry(const uint8_t * p, const uint8_t * end);
+
+    std::vector<Tag> tagx;
+    size_t controlBytes;
+    std::vector<std::string> cncxRecs;
+};
+
+#endif	/* MOBIINDEX_H */
@@ -0,0 +1,359 @@
+/* 
+ * Output
+ * Backends for the files written by Dumper
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "Output.h"
+#include "ThreadPool.h"
+#include "Utils.h"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <zlib.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define err(msg) std::cerr << "[ERROR] " << msg << std::endl;
+
+using std::string;
+
+string DirOutput::path(const string & name) {
+    return dir + SEP + name;
+}
+
+void DirOutput::write(const string & name, string content) {
+    write(name, content.data(), content.size());
+}
+
+void DirOutput::write(const string & name, const char * data, size_t len) {
+    FILE * f = fopen(path(name).c_str(), "wb");
+    if(!f) {
+	err("can't create " << name);
+	return;
+    }
+    if(fwrite(data, 1, len, f) != len)
+	err("short write on " << name);
+    fclose(f);
+}
+
+bool DirOutput::link(const string & name, const string & target) {
+    std::lock_guard<std::mutex> lock(linkMutex);
+    links.push_back(std::make_pair(name, target));
+    return true;
+}
+
+void DirOutput::flush() {
+    std::lock_guard<std::mutex> lock(linkMutex);
+    for(size_t i = 0; i < links.size(); ++i) {
+	string to = path(links[i].first), from = path(links[i].second);
+#ifndef _WIN32
+	unlink(to.c_str());
+	if(::link(from.c_str(), to.c_str()) == 0) continue;
+#endif
+	// no hardlinks here, copy the file
+	FILE * f = fopen(from.c_str(), "rb");
+	if(!f) {
+	    err("can't read " << links[i].second);
+	    continue;
+	}
+	string content;
+	char buf[BUFSIZ];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) content.append(buf, n);
+	fclose(f);
+	DirOutput::write(links[i].first, content.data(), content.size());
+    }
+    links.clear();
+}
+
+void BatchOutput::write(const string & name, string content) {
+    Op op;
+    op.path = path(name);
+    op.data = NULL;
+    op.len = content.size();
+    op.done = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    ops.push_back(op);
+    ops.back().content.swap(content);
+}
+
+void BatchOutput::write(const string & name, const char * data, size_t len) {
+    Op op;
+    op.path = path(name);
+    op.data = data;
+    op.len = len;
+    op.done = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    ops.push_back(op);
+}
+
+void BatchOutput::flush() {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	// what io_uring didn't write (or can't) goes to the pool
+	if(!ops.empty()) {
+	    flushUring();
+	    flushPool();
+	}
+	ops.clear();
+    }
+    // links need their targets on disk
+    DirOutput::flush();
+}
+
+BatchOutput::~BatchOutput() {
+    flush();
+}
+
+// create path with its final size and write it (with pwrite)
+static void writeFile(const string & path, const char * data, size_t len) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+	err("can't create " << path);
+	return;
+    }
+#ifdef __linux__
+    if(len > 0) fallocate(fd, 0, 0, len);
+#endif
+    size_t done = 0;
+    while(done < len) {
+	ssize_t n = pwrite(fd, data + done, len - done, done);
+	if(n < 0 && errno == EINTR) continue;
+	if(n <= 0) {
+	    err("short write on " << path);
+	    break;
+	}
+	done += n;
+    }
+    close(fd);
+}
+
+void BatchOutput::flushPool() {
+    size_t pending = 0;
+    for(size_t i = 0; i < ops.size(); ++i)
+	if(!ops[i].done) ++pending;
+    if(pending == 0) return;
+
+    ThreadPool pool(threads);
+    for(size_t i = 0; i < ops.size(); ++i) {
+	const Op * op = &ops[i];
+	if(op->done) continue;
+	pool.submit([op]() { writeFile(op->path, op->bytes(), op->len); });
+    }
+    pool.wait();
+}
+
+#ifdef HAVE_LIBURING
+// ring entries: up to 3 per file (fallocate, write, close)
+#define RING_DEPTH 96
+
+static bool uringSupported(struct io_uring * ring) {
+    struct io_uring_probe * probe = io_uring_get_probe_ring(ring);
+    if(!probe) return false;
+    bool ok = io_uring_opcode_supported(probe, IORING_OP_FALLOCATE) &&
+	    io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+	    io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+    io_uring_free_probe(probe);
+    return ok;
+}
+
+// Files are opened here; preallocation, write and close of each file
+// are submitted as one hard-linked chain, so that the close always runs
+bool BatchOutput::flushUring() {
+    struct io_uring ring;
+    if(io_uring_queue_init(RING_DEPTH, &ring, 0) < 0)
+	return false;
+    if(!uringSupported(&ring)) {
+	io_uring_queue_exit(&ring);
+	return false;
+    }
+
+    size_t next = 0;
+    unsigned inflight = 0;
+    struct io_uring_sqe * sqe;
+    struct io_uring_cqe * cqe;
+    while(next < ops.size() || inflight > 0) {
+	while(next < ops.size() && io_uring_sq_space_left(&ring) >= 3) {
+	    Op & op = ops[next++];
+	    // the write length is 32 bits: bigger files are left to the pool
+	    if(op.len > UINT_MAX) continue;
+	    int fd = open(op.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	    if(fd < 0) {
+		err("can't create " << op.path);
+		continue;
+	    }
+	    if(op.len > 0) {
+		// a failed fallocate is harmless, and doesn't break the chain
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_fallocate(sqe, fd, 0, 0, op.len);
+		io_uring_sqe_set_data(sqe, NULL);
+		sqe->flags |= IOSQE_IO_HARDLINK;
+		++inflight;
+	    }
+	    sqe = io_uring_get_sqe(&ring);
+	    io_uring_prep_write(sqe, fd, op.bytes(), op.len, 0);
+	    io_uring_sqe_set_data(sqe, &op);
+	    sqe->flags |= IOSQE_IO_HARDLINK;
+	    sqe = io_uring_get_sqe(&ring);
+	    io_uring_prep_close(sqe, fd);
+	    io_uring_sqe_set_data(sqe, NULL);
+	    inflight += 2;
+	}
+	if(inflight == 0) continue;
+	io_uring_submit(&ring);
+	if(io_uring_wait_cqe(&ring, &cqe) < 0) {
+	    // the writes not completed are done again by the pool
+	    err("io_uring wait failed");
+	    break;
+	}
+	// a failed or short write is left for the pool too
+	Op * op = (Op*)io_uring_cqe_get_data(cqe);
+	if(op) op->done = cqe->res >= 0 && (size_t)cqe->res == op->len;
+	io_uring_cqe_seen(&ring, cqe);
+	--inflight;
+    }
+
+    io_uring_queue_exit(&ring);
+    return true;
+}
+#else
+bool BatchOutput::flushUring() {
+    return false;
+}
+#endif
+
+// zip records, all little endian
+#define ZIP_LOCAL_SIG	0x04034b50
+#define ZIP_CENTRAL_SIG	0x02014b50
+#define ZIP_END_SIG	0x06054b50
+#define ZIP_VERSION	20
+#define ZIP_UTF8	0x0800	// names are utf-8
+#define ZIP_MAX		0xffffffffULL	// no zip64
+
+static void put16(string & b, uint16_t v) {
+    b.push_back(v & 0xff);
+    b.push_back(v >> 8);
+}
+
+static void put32(string & b, uint32_t v) {
+    put16(b, v & 0xffff);
+    put16(b, v >> 16);
+}
+
+ZipOutput::ZipOutput(const char * path) : finished(false), failed(false), offset(0) {
+    if(!strcmp(path, "-")) file = stdout;
+    else file = fopen(path, "wb");
+
+    time_t now = time(NULL);
+    struct tm * t = localtime(&now);
+    dosTime = (t->tm_hour << 11) | (t->tm_min << 5) | (t->tm_sec / 2);
+    dosDate = ((t->tm_year - 80) << 9) | ((t->tm_mon + 1) << 5) | t->tm_mday;
+}
+
+void ZipOutput::write(const string & name, string content) {
+    write(name, content.data(), content.size());
+}
+
+void ZipOutput::write(const string & name, const char * data, size_t len) {
+    if(!file) return;
+    uint32_t crc = crc32(0L, (const Bytef*)data, len);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(offset + 30 + name.size() + len > ZIP_MAX) {
+	err("archive too big, skipping " << name);
+	failed = true;
+	return;
+    }
+    Entry e;
+    e.name = name;
+    e.crc = crc;
+    e.size = len;
+    e.offset = offset;
+    entries.push_back(e);
+
+    string h;
+    put32(h, ZIP_LOCAL_SIG);
+    put16(h, ZIP_VERSION);
+    put16(h, ZIP_UTF8);
+    put16(h, 0); // stored
+    put16(h, dosTime);
+    put16(h, dosDate);
+    put32(h, crc);
+    put32(h, len); // compressed size
+    put32(h, len);
+    put16(h, name.size());
+    put16(h, 0); // extra length
+    h.append(name);
+    fwrite(h.data(), 1, h.size(), file);
+    fwrite(data, 1, len, file);
+    offset += h.size() + len;
+}
+
+void ZipOutput::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(file) fflush(file);
+}
+
+// write the central directory: false if some file was left out, or
+// there are too many entries (no zip64 records are written)
+bool ZipOutput::finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!file || finished) return !failed;
+    finished = true;
+    if(entries.size() > 0xffff) {
+	err("too many entries for a zip archive");
+	failed = true;
+    }
+    if(failed) return false;
+
+    string cd;
+    for(std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+	put32(cd, ZIP_CENTRAL_SIG);
+	put16(cd, ZIP_VERSION); // made by
+	put16(cd, ZIP_VERSION);
+	put16(cd, ZIP_UTF8);
+	put16(cd, 0); // stored
+	put16(cd, dosTime);
+	put16(cd, dosDate);
+	put32(cd, it->crc);
+	put32(cd, it->size);
+	put32(cd, it->size);
+	put16(cd, it->name.size());
+	put16(cd, 0); // extra length
+	put16(cd, 0); // comment length
+	put16(cd, 0); // disk
+	put16(cd, 0); // internal attributes
+	put32(cd, 0); // external attributes
+	put32(cd, it->offset);
+	cd.append(it->name);
+    }
+    uint32_t cdSize = cd.size();
+    put32(cd, ZIP_END_SIG);
+    put16(cd, 0); // disk
+    put16(cd, 0); // central directory disk
+    put16(cd, entries.size());
+    put16(cd, entries.size());
+    put32(cd, cdSize);
+    put32(cd, offset);
+    put16(cd, 0); // comment length
+    fwrite(cd.data(), 1, cd.size(), file);
+    if(fflush(file) != 0 || ferror(file)) {
+	err("error writing the archive");
+	failed = true;
+    }
+    return !failed;
+}
+
+ZipOutput::~ZipOutput() {
+    if(!file) return;
+    finish();
+    if(file == stdout) fflush(file);
+    else fclose(file);
+}
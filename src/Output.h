@@ -0,0 +1,140 @@
+/* 
+ * Output
+ * Backends for the files written by Dumper
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef OUTPUT_H
+#define	OUTPUT_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Backends can be called concurrently by the dumper's workers.
+ * Names are plain file names, without directories.
+ */
+class Output {
+public:
+    // content is moved in, and released once written
+    virtual void write(const std::string & name, std::string content) = 0;
+    // data is not copied: it must stay valid until flush()
+    virtual void write(const std::string & name, const char * data, size_t len) = 0;
+    // make name a copy of target (written before or in the same flush),
+    // without writing the data again; false if not supported
+    virtual bool link(const std::string &, const std::string &) { return false; }
+    // complete all pending writes
+    virtual void flush() {}
+    // complete the output once everything is written: false if
+    // it couldn't be completed (e.g. an archive that can't be valid)
+    virtual bool finish() { flush(); return true; }
+
+    virtual ~Output() {}
+};
+
+/*
+ * Synchronous writes in a directory
+ */
+class DirOutput : public Output {
+public:
+    DirOutput(const char * dir) : dir(dir) {}
+
+    void write(const std::string & name, std::string content);
+    void write(const std::string & name, const char * data, size_t len);
+    // hardlinks, made on flush()
+    bool link(const std::string & name, const std::string & target);
+    void flush();
+
+protected:
+    std::string path(const std::string & name);
+    std::string dir;
+
+private:
+    std::vector<std::pair<std::string, std::string> > links;
+    std::mutex linkMutex;
+};
+
+/*
+ * Writes nothing: for dumpers run only for their metadata
+ */
+class NullOutput : public Output {
+public:
+    void write(const std::string &, std::string) {}
+    void write(const std::string &, const char *, size_t) {}
+    bool link(const std::string &, const std::string &) { return true; }
+};
+
+/*
+ * Queues the files and writes them all on flush(): with io_uring
+ * if built with it (make URING=1), otherwise with a pool of threads
+ * doing pwrite; the pool also writes again what io_uring couldn't.
+ * Files are preallocated to their final size.
+ */
+class BatchOutput : public DirOutput {
+public:
+    BatchOutput(const char * dir, int threads = 4) : DirOutput(dir), threads(threads) {}
+
+    void write(const std::string & name, std::string content);
+    void write(const std::string & name, const char * data, size_t len);
+    void flush();
+
+    virtual ~BatchOutput();
+
+private:
+    struct Op {
+	std::string	path;
+	std::string	content;  // owned data, if data is NULL
+	const char *	data;
+	size_t		len;
+	bool		done;	  // written by io_uring
+	const char * bytes() const { return data ? data : content.data(); }
+    };
+
+    bool flushUring();
+    void flushPool();
+
+    std::vector<Op> ops;
+    std::mutex mutex;
+    int threads;
+};
+
+/*
+ * Everything in a single uncompressed zip archive, written
+ * sequentially to a file or to stdout ("-"). The central
+ * directory at the end is the index of the entries, so they
+ * can be located without scanning the archive.
+ * The archive is completed when the object is destroyed.
+ */
+class ZipOutput : public Output {
+public:
+    ZipOutput(const char * path);
+
+    bool isValid() { return file != NULL; }
+    void write(const std::string & name, std::string content);
+    void write(const std::string & name, const char * data, size_t len);
+    void flush();
+    // write the central directory (called by the destructor if needed)
+    bool finish();
+
+    virtual ~ZipOutput();
+
+private:
+    struct Entry {
+	std::string	name;
+	uint32_t	crc, size, offset;
+    };
+
+    FILE * file;
+    bool finished, failed;
+    uint64_t offset;
+    uint16_t dosTime, dosDate;
+    std::vector<Entry> entries;
+    std::mutex mutex;
+};
+
+#endif	/* OUTPUT_H */
@@ -0,0 +1,60 @@
+/* 
+ * ThreadPool
+ * fixed set of worker threads running queued jobs
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int threads) : running(0), stopping(false) {
+    if(threads < 1) threads = 1;
+    for(int i = 0; i < threads; ++i)
+	workers.push_back(std::thread(&ThreadPool::run, this));
+}
+
+void ThreadPool::submit(std::function<void()> job) {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	jobs.push_back(job);
+    }
+    hasJobs.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(!jobs.empty() || running > 0)
+	idle.wait(lock);
+}
+
+void ThreadPool::run() {
+    std::function<void()> job;
+    for(;;) {
+	{
+	    std::unique_lock<std::mutex> lock(mutex);
+	    while(jobs.empty() && !stopping)
+		hasJobs.wait(lock);
+	    if(jobs.empty()) return;
+	    job = jobs.front();
+	    jobs.pop_front();
+	    ++running;
+	}
+	job();
+	{
+	    std::lock_guard<std::mutex> lock(mutex);
+	    --running;
+	    if(jobs.empty() && running == 0) idle.notify_all();
+	}
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	stopping = true;
+    }
+    hasJobs.notify_all();
+    for(size_t i = 0; i < workers.size(); ++i)
+	workers[i].join();
+}
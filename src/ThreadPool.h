@@ -0,0 +1,41 @@
+/* 
+ * ThreadPool
+ * fixed set of worker threads running queued jobs
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#ifndef THREADPOOL_H
+#define	THREADPOOL_H
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+public:
+    ThreadPool(int threads);
+
+    // queue a job; jobs start in submission order
+    void submit(std::function<void()> job);
+    // block until every queued job has finished
+    void wait();
+
+    virtual ~ThreadPool();
+
+private:
+    void run();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > jobs;
+    std::mutex mutex;
+    std::condition_variable hasJobs, idle;
+    int running;
+    bool stopping;
+};
+
+#endif	/* THREADPOOL_H */
@@ -15,3 +15,11 @@ std::string replaceAll(std::string & src, std::string what, std::string with) {
     return src;
 }
 
+uint64 fnv1a(const char * data, size_t len) {
+    uint64 h = 0xcbf29ce484222325ULL;
+    for(const uint8 * p = (const uint8 *)data, * end = p + len; p < end; ++p) {
+	h ^= *p;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
@@ -85,5 +85,8 @@ STATIC_ASSERT(4 == sizeof(uint32),  uint32_is_4_bytes);
 STATIC_ASSERT(8 == sizeof(int64),   int64_is_8_bytes);
 STATIC_ASSERT(8 == sizeof(uint64),  uint64_is_8_bytes);
 
+// 64 bit FNV-1a, a fast non cryptographic hash
+uint64 fnv1a(const char * data, size_t len);
+
 std::string replaceAll(std::string & src, std::string what, std::string with);
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <libxml2/libxml/tree.h>
 
 #include "Xml.h"
+#include <mutex>
 
 bool Xml::initDone = Xml::doInit();
 
@@ -18,25 +19,80 @@ bool Xml::doInit() {
 }
 
 
-Xml::Xml(string xmlstring) {
-    //strip "default" namespace
-    size_t pos = xmlstring.find("xmlns="), pos1, pos2;
-    if (pos != string::npos) {
-        pos1 = xmlstring.find('"', pos); //open quotes
-        pos1 = xmlstring.find('"', pos1+1); //close
-        xmlstring.erase(pos, pos1-pos+1);
-    }
-    doc = xmlReadMemory(xmlstring.c_str(), xmlstring.size(),
+Xml::Xml(const char * data, size_t len) {
+    doc = xmlReadMemory(data, len,
+            "Xml.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET );
+}
+
+Xml::Xml(const string & xmlstring) {
+    doc = xmlReadMemory(xmlstring.data(), xmlstring.size(),
             "Xml.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET );
 }
 
-std::vector<string> Xpath::query(string expr) {
+// default namespace declared by the root element, NULL if none
+static xmlNs * defaultNs(xmlDoc * doc) {
+    xmlNode * root = doc ? xmlDocGetRootElement(doc) : NULL;
+    if(!root) return NULL;
+    for(xmlNs * ns = root->nsDef; ns != NULL; ns = ns->next)
+	if(ns->prefix == NULL) return ns;
+    return NULL;
+}
+
+string Xml::defaultPrefix() {
+    return defaultNs(doc) ? XML_DEFAULT_NS ":" : "";
+}
+
+// Expressions are compiled once and kept for the life of the process.
+// Use $variables rather than building a new expression for each value.
+class XpathCache {
+public:
+    xmlXPathCompExpr * get(const string & expr) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<string, xmlXPathCompExpr *>::iterator it = exprs.find(expr);
+	if(it != exprs.end()) return it->second;
+	xmlXPathCompExpr * comp = xmlXPathCompile((xmlChar*)expr.c_str());
+	exprs[expr] = comp;
+	return comp;
+    }
+
+    ~XpathCache() {
+	for(std::map<string, xmlXPathCompExpr *>::iterator it = exprs.begin(); it != exprs.end(); ++it)
+	    if(it->second) xmlXPathFreeCompExpr(it->second);
+    }
+
+private:
+    std::map<string, xmlXPathCompExpr *> exprs;
+    std::mutex mutex;
+};
+
+static XpathCache xpathCache;
+
+xmlXPathCompExpr * Xpath::compile(const string & expr) {
+    return xpathCache.get(expr);
+}
+
+xmlXPathObject * Xpath::eval(const string & expr, const varlist * vars) {
+    xmlXPathCompExpr * comp = compile(expr);
+    if(!comp) return NULL;
+
+    if(vars) for(varlist::const_iterator it = vars->begin(); it != vars->end(); ++it) {
+	xmlXPathRegisterVariable(context, (xmlChar*)it->first.c_str(),
+		xmlXPathNewString((xmlChar*)it->second.c_str()));
+    }
+    xmlXPathObject * result = xmlXPathCompiledEval(comp, context);
+    if(vars) for(varlist::const_iterator it = vars->begin(); it != vars->end(); ++it) {
+	xmlXPathRegisterVariable(context, (xmlChar*)it->first.c_str(), NULL);
+    }
+    return result;
+}
+
+std::vector<string> Xpath::query(const string & expr, const varlist * vars) {
     std::vector<string> res;
     if(!context) {
         return res;
     }
     
-    xmlXPathObject * result = xmlXPathEvalExpression((xmlChar*)expr.c_str(), context);
+    xmlXPathObject * result = eval(expr, vars);
 
     xmlNodeSet * nodeset;
     xmlChar * nsi;
@@ -60,12 +116,43 @@ std::vector<string> Xpath::query(string expr) {
     return res;
 }
 
-string	Xpath::get(string expr) {
-    std::vector<string> res = query(expr);
+string	Xpath::get(const string & expr, const varlist * vars) {
+    std::vector<string> res = query(expr, vars);
     if(res.size()) return res[0];
     return "";
 }
 
+// Return the element nodes matching expr, with all their attributes,
+// so that callers can read several attributes with a single query
+std::vector<XmlElement> Xpath::elements(const string & expr, const varlist * vars) {
+    std::vector<XmlElement> res;
+    if(!context) {
+        return res;
+    }
+
+    xmlXPathObject * result = eval(expr, vars);
+
+    if(result && result->type == XPATH_NODESET && result->nodesetval) {
+	xmlNodeSet * nodeset = result->nodesetval;
+	res.reserve(nodeset->nodeNr);
+	for (int i=0; i < nodeset->nodeNr; i++) {
+	    xmlNode * cn = nodeset->nodeTab[i];
+	    if(cn->type != XML_ELEMENT_NODE) continue;
+	    res.push_back(XmlElement());
+	    XmlElement & el = res.back();
+	    el.name = (char *)cn->name;
+	    for(xmlAttr * at = cn->properties; at != NULL; at = at->next) {
+		xmlChar * av = xmlNodeListGetString(context->doc, at->children, 1);
+		el.attributes[(char *)at->name] = av ? (char *)av : "";
+		if(av) xmlFree(av);
+	    }
+	}
+    }
+
+    xmlXPathFreeObject(result);
+    return res;
+}
+
 Xml::~Xml() {
     if(doc) xmlFreeDoc(doc);
 }
@@ -79,6 +166,10 @@ Xpath::Xpath(xmlDoc * doc, nslist * ns) {
 		xmlXPathRegisterNs(context, 
 		(xmlChar*)it->first.c_str() , (xmlChar*)it->second.c_str());
     }
+    // xpath 1.0 has no default namespace: it gets a prefix
+    xmlNs * dns = defaultNs(doc);
+    if(dns && context)
+	xmlXPathRegisterNs(context, (xmlChar*)XML_DEFAULT_NS, dns->href);
 }
 
 Xpath::~Xpath() {
@@ -92,4 +183,47 @@ string Xpath::nodeValue(xmlNode *node) {
 	    res.append(nodeValue(it));
 	}
 	return res;
-}
\ No newline at end of file
+}
+
+#define READER_OPTS XML_PARSE_RECOVER | XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING
+
+XmlReader::XmlReader(const char * data, size_t len) {
+    reader = xmlReaderForMemory(data, len, "Xml.xml", "UTF-8", READER_OPTS);
+}
+
+XmlReader::XmlReader(xmlInputReadCallback readfn, xmlInputCloseCallback closefn, void * ctx) {
+    reader = xmlReaderForIO(readfn, closefn, ctx, "Xml.xml", "UTF-8", READER_OPTS);
+}
+
+bool XmlReader::next() {
+    return reader && xmlTextReaderRead(reader) == 1;
+}
+
+string XmlReader::name() {
+    const xmlChar * n = xmlTextReaderConstLocalName(reader);
+    return n ? (char *)n : "";
+}
+
+string XmlReader::attribute(const char * name) {
+    string res;
+    xmlChar * v = xmlTextReaderGetAttribute(reader, (xmlChar*)name);
+    if(v) {
+	res = (char *)v;
+	xmlFree(v);
+    }
+    return res;
+}
+
+string XmlReader::text() {
+    string res;
+    xmlChar * v = xmlTextReaderReadString(reader);
+    if(v) {
+	res = (char *)v;
+	xmlFree(v);
+    }
+    return res;
+}
+
+XmlReader::~XmlReader() {
+    if(reader) xmlFreeTextReader(reader);
+}
@@ -15,38 +15,53 @@
 #include <libxml/parser.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
+#include <libxml/xmlreader.h>
 
 using std::string;
 
 typedef std::map<string, string> nslist;
+// prefix of the root's default namespace in xpath expressions
+#define XML_DEFAULT_NS	"default"
+// values for $variables in xpath expressions
+typedef std::map<string, string> varlist;
+
+typedef struct {
+    string name;
+    std::map<string, string> attributes;
+} XmlElement;
 
 class Xpath {
 	friend class Xml;
 public:
-	std::vector<string>	query(string expr);
-	string		get(string expr);
+	std::vector<string>	query(const string & expr, const varlist * vars = NULL);
+	string		get(const string & expr, const varlist * vars = NULL);
+	std::vector<XmlElement>	elements(const string & expr, const varlist * vars = NULL);
 
 	~Xpath();    
 
 private:
 	Xpath(xmlDoc * doc, nslist * ns);
 	string nodeValue(xmlNode *node);
+	xmlXPathObject * eval(const string & expr, const varlist * vars);
 	xmlXPathContext * context;
+
+	// compiled expressions, shared by all the documents
+	static xmlXPathCompExpr * compile(const string & expr);
 	
 };
 
 class Xml {
 public:
-/*    typedef struct {
-	string value, name;
-	std::map<string, string> attributes;
-    } Element;
-*/
-  
-    Xml(string xmlstring);
+    // the buffer is parsed in place, and only needs to
+    // live for the duration of the constructor
+    Xml(const char * data, size_t len);
+    Xml(const string & xmlstring);
     
     bool isValid() { return doc!=NULL; }
     Xpath xpath(nslist * ns = NULL) { return Xpath(doc, ns); }
+    // "default:" if the root declares a default namespace, else "":
+    // unprefixed elements are matched as "//" + defaultPrefix() + "name"
+    string defaultPrefix();
     
     virtual ~Xml();
 
@@ -58,5 +73,32 @@ private:
     static bool doInit();
 };
 
+/*
+ * Pull parser, for lookups that can stop early
+ * and don't need the whole tree in memory
+ */
+class XmlReader {
+public:
+    XmlReader(const char * data, size_t len);
+    XmlReader(xmlInputReadCallback readfn, xmlInputCloseCallback closefn, void * ctx);
+
+    bool isValid() { return reader!=NULL; }
+    // advance to the next node, false at the end or on errors
+    bool next();
+    bool isElement() { return xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT; }
+    bool isEndElement() { return xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT; }
+    int depth() { return xmlTextReaderDepth(reader); }
+    // local name of the current node
+    string name();
+    string attribute(const char * name);
+    // text content of the current element
+    string text();
+
+    virtual ~XmlReader();
+
+private:
+    xmlTextReader * reader;
+};
+
 #endif	/* XML_H */
 
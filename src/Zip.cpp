@@ -15,12 +15,21 @@ Zip::Zip(const char * path) {
     archive = zip_open(path, ZIP_CHECKCONS, NULL);
 }
 
+bool Zip::open(const char * path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(archive) zip_close(archive);
+    archive = zip_open(path, ZIP_CHECKCONS, NULL);
+    return archive != NULL;
+}
+
 bool Zip::hasFile(const char * path) {
     if(!isValid()) return false;
+    std::lock_guard<std::mutex> lock(mutex);
     return zip_name_locate(archive, path, ZIP_FL_NOCASE) != -1;
 }
 
 string Zip::getFile(string path) {
+    std::lock_guard<std::mutex> lock(mutex);
     int pos = zip_name_locate(archive, path.c_str(), ZIP_FL_NOCASE) != -1;
     if(pos < 0 ) return "";
     
@@ -38,6 +47,7 @@ string Zip::getFile(string path) {
 }
 
 std::vector<unsigned char> Zip::getBinaryFile(std::string path) {
+    std::lock_guard<std::mutex> lock(mutex);
     int pos = zip_name_locate(archive, path.c_str(), ZIP_FL_NOCASE) != -1;
     std::vector<unsigned char> res;
     if(pos < 0 ) return res;
@@ -54,6 +64,47 @@ std::vector<unsigned char> Zip::getBinaryFile(std::string path) {
     return res;    
 }
 
+string Zip::getPrefix(string path, size_t len) {
+    string res;
+    if(!isValid()) return res;
+    std::lock_guard<std::mutex> lock(mutex);
+    zip_file * f = zip_fopen(archive, path.c_str(), ZIP_FL_NOCASE);
+    if(!f) return res;
+    res.resize(len);
+    size_t got = 0;
+    int read;
+    while(got < len && (read = zip_fread(f, &res[got], len - got)) > 0)
+	got += read;
+    zip_fclose(f);
+    res.resize(got);
+    return res;
+}
+
+bool Zip::stat(string path, uint32_t & crc, uint64_t & size) {
+    if(!isValid()) return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    struct zip_stat st;
+    if(zip_stat(archive, path.c_str(), ZIP_FL_NOCASE, &st) != 0
+	    || !(st.valid & ZIP_STAT_CRC) || !(st.valid & ZIP_STAT_SIZE))
+	return false;
+    crc = st.crc;
+    size = st.size;
+    return true;
+}
+
+void * Zip::openFile(string path) {
+    if(!isValid()) return NULL;
+    return zip_fopen(archive, path.c_str(), ZIP_FL_NOCASE);
+}
+
+int Zip::read(void * ctx, char * buf, int len) {
+    return zip_fread((zip_file*)ctx, buf, len);
+}
+
+int Zip::close(void * ctx) {
+    return zip_fclose((zip_file*)ctx);
+}
+
 Zip::~Zip() {
     if(isValid()) zip_close(archive);
 }
@@ -12,19 +12,35 @@
 #include <zip.h>
 #include <string>
 #include <vector>
+#include <mutex>
 
 class Zip {
 public:
     Zip(const char * path);
+    // close the archive and open another one
+    bool open(const char * path);
     
     bool isValid() { return archive!=NULL; }
     bool hasFile(const char * path);
     std::string getFile(std::string path);
     std::vector<unsigned char> getBinaryFile(std::string path);
+    // the first len bytes of a file (less if it's shorter)
+    std::string getPrefix(std::string path, size_t len);
+    // crc32 and size of a file from the archive directory, nothing is read
+    bool stat(std::string path, uint32_t & crc, uint64_t & size);
+
+    // Sequential access to a file, for streaming parsers
+    // (not synchronized, use from one thread at a time):
+    // openFile returns the context for read/close (NULL if not found)
+    void * openFile(std::string path);
+    static int read(void * ctx, char * buf, int len);
+    static int close(void * ctx);
     virtual ~Zip();
 
 private:
     zip * archive;
+    // libzip archives can't be read concurrently
+    std::mutex mutex;
 };
 
 #endif	/* ZIP_H */
@@ -0,0 +1,119 @@
+/* 
+ * bookcover - extract the cover image of ebooks
+ * reading only the headers and the cover itself
+ * 
+ * Author:  Domenico Rotiroti
+ * License: GPL3 (see COPYING)
+ */
+
+#include "MobiBook.h"
+#include "Epub.h"
+#include "ImageInfo.h"
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <stdio.h>
+
+using std::string; 
+using std::cerr;
+
+// opens the output once the image type (its extension) is known
+typedef std::function<FILE * (const char * ext)> Opener;
+
+static bool endsWith(const string & s, const char * suffix) {
+    size_t len = strlen(suffix);
+    return s.length() >= len && s.compare(s.length()-len, len, suffix) == 0;
+}
+
+static bool closeOutput(FILE * out) {
+    return out == stdout ? fflush(out) == 0 : fclose(out) == 0;
+}
+
+static bool mobiCover(const string & file, Opener open) {
+    MobiBook * m = MobiBook::createFromFile(file.c_str(), MOBI_COVER);
+    if(m==NULL) return false;
+    size_t len;
+    const char * data = m->readCover(len);
+    bool ok = false;
+    if(data) {
+	ImageInfo info;
+	probeImage(data, len, info);
+	FILE * out = open(info.type);
+	if(out) {
+	    ok = fwrite(data, 1, len, out) == len;
+	    ok = closeOutput(out) && ok;
+	}
+    }
+    delete m;
+    return ok;
+}
+
+static bool epubCover(const string & file, Opener open) {
+    Epub * e = Epub::createFromFile(file.c_str(), EPUB_COVER);
+    if(e==NULL) return false;
+    ImageInfo info;
+    bool ok = false;
+    if(e->getCover() >= 0 && e->resourceInfo(e->getCover(), info)) {
+	FILE * out = open(info.type);
+	if(out) {
+	    ok = e->copyResource(e->getCover(), out);
+	    ok = closeOutput(out) && ok;
+	}
+    }
+    delete e;
+    return ok;
+}
+
+static bool writeCover(const string & file, Opener open) {
+    bool ok = false;
+    if(endsWith(file, ".mobi") || endsWith(file, ".azw3"))
+	ok = mobiCover(file, open);
+    else if(endsWith(file, ".epub"))
+	ok = epubCover(file, open);
+    if(!ok) cerr << "No cover for " << file << std::endl;
+    return ok;
+}
+
+/*
+ * Batch mode: the cover of each book is written in outdir, named as
+ * the book plus the extension of the image (book.epub.jpg)
+ */
+static int batch(const string & outdir, int count, char** files) {
+    int res = 0;
+    for(int i = 0; i < count; ++i) {
+	string name = files[i];
+	name = name.substr(name.find_last_of('/') + 1);
+	name = outdir + "/" + name;
+	bool ok = writeCover(files[i], [&name](const char * ext) {
+	    FILE * f = fopen((name + ext).c_str(), "wb");
+	    if(!f) cerr << "Unable to create " << name << ext << std::endl;
+	    return f;
+	});
+	if(!ok) res = 1;
+    }
+    return res;
+}
+
+/*
+ * 1st arg is ebook path, 2nd the image file ("-" for stdout)
+ */
+int main(int argc, char** argv) {
+    if(argc > 3 && !strcmp(argv[1], "-d"))
+	return batch(argv[2], argc-3, argv+3);
+
+    if(argc == 3) {
+	string path = argv[2];
+	bool ok = writeCover(argv[1], [&path](const char *) {
+	    if(path == "-") return stdout;
+	    FILE * f = fopen(path.c_str(), "wb");
+	    if(!f) cerr << "Unable to create " << path << std::endl;
+	    return f;
+	});
+	return ok ? 0 : 1;
+    }
+
+    cerr << "Usage: " << argv[0] << " <ebook> <image|->" << std::endl;
+    cerr << "       " << argv[0] << " -d <outdir> <ebook>..." << std::endl;
+    return 1;
+}
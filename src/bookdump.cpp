@@ -8,25 +8,50 @@
 #include "MobiBook.h"
 #include "MobiDumper.h"
 #include "Epub.h"
+#include "Output.h"
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
 
 using std::string; 
 using std::cerr;
 using std::vector;
 
+static int usage() {
+    cerr << "Usage: bookdump [-j threads] [-b] [-c] <ebook> <outdir|archive.zip|->" << std::endl;
+    return 1;
+}
+
 /*
  * Dump ebook content in a directory
+ * options:
+ *   -j threads	number of worker threads
+ *   -b		batch the writes (io_uring or thread pool)
+ *   -c		write the metadata as cbor (info.cbor)
  * 1st arg is ebook path
- * 2nd arg is output dir
+ * 2nd arg is output dir, or a .zip archive ("-" for stdout)
  */
 int main(int argc, char** argv) {
-    if(argc == 3) {
+    int threads = 1, opt;
+    int format = META_JSON;
+    bool batch = false;
+    while((opt = getopt(argc, argv, "j:bc")) != -1) {
+	if(opt == 'j') threads = atoi(optarg);
+	else if(opt == 'b') batch = true;
+	else if(opt == 'c') format = META_CBOR;
+	else return usage();
+    }
+    argc -= optind;
+    argv += optind - 1;
+
+    if(argc == 2) {
 	Ebook * m = NULL;
 	string file = argv[1];
 
 	if(file.find(".mobi",file.length()-5, 5) != string::npos)
-	    m = (Ebook*) MobiBook::createFromFile(argv[1]);
+	    m = (Ebook*) MobiBook::createFromFile(argv[1], MOBI_INDEX_LINKS);
 	else if(file.find(".epub",file.length()-5, 5) != string::npos)
 	    m = (Ebook*) Epub::createFromFile(argv[1]);
 
@@ -35,15 +60,33 @@ int main(int argc, char** argv) {
 	    return 1;
 	}
 
+	string out = argv[2];
 	Dumper * h = m->getDumper(argv[2]);
-	h->dump();
+	h->setThreads(threads);
+	h->setFormat(format);
+	if(out == "-" || (out.length() > 4 && out.find(".zip", out.length()-4) != string::npos)) {
+	    ZipOutput * zo = new ZipOutput(argv[2]);
+	    if(!zo->isValid()) {
+		cerr << "Unable to create " << out << std::endl;
+		delete zo;
+		delete h;
+		delete m;
+		return 1;
+	    }
+	    h->setOutput(zo);
+	}
+	else if(batch) h->setOutput(new BatchOutput(argv[2], std::max(threads, 4)));
+	int res = 0;
+	if(!h->dump()) {
+	    cerr << "Unable to complete " << out << std::endl;
+	    res = 1;
+	}
 
 	delete h;
 	delete m;
-	return 0;
+	return res;
     }
 
     //bad args
-    cerr << "Usage: " << argv[0] << " <ebook> <outdir>" << std::endl;
-    return 1;
+    return usage();
 }
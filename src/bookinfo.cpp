@@ -9,23 +9,161 @@
 #include "MobiBook.h"
 #include "Epub.h"
 #include "Locale.h"
+#include "MetaWriter.h"
+#include "Cbor.h"
+#include <memory>
 #include <iostream>
+#include <string.h>
+#include <stdio.h>
 
 using std::string; 
 using std::cerr;
 
+static bool isMobi(const string & file) {
+    return file.find(".mobi",file.length()-5, 5) != string::npos;
+}
+
+static bool isEpub(const string & file) {
+    return file.find(".epub",file.length()-5, 5) != string::npos;
+}
+
+// the metadata is in the headers, the text is not decoded
+static Ebook * openBook(const string & file) {
+    if(isMobi(file))
+	return MobiBook::createFromFile(file.c_str(), MOBI_NO_TEXT);
+    else if(isEpub(file))
+	return Epub::createFromFile(file.c_str(), EPUB_METADATA);
+    return NULL;
+}
+
+// fully opened, as for bookdump, reusing the objects (and
+// their buffers) of the previous books of the same format
+static Ebook * reopenBook(const string & file, std::unique_ptr<MobiBook> & mobi,
+	std::unique_ptr<Epub> & epub) {
+    if(isMobi(file)) {
+	if(!mobi) mobi.reset(MobiBook::createFromFile(file.c_str(), MOBI_INDEX_LINKS));
+	else if(!mobi->reopen(file.c_str(), MOBI_INDEX_LINKS)) return NULL;
+	return mobi.get();
+    } else if(isEpub(file)) {
+	if(!epub) epub.reset(Epub::createFromFile(file.c_str(), EPUB_FULL));
+	else if(!epub->reopen(file.c_str(), EPUB_FULL)) return NULL;
+	return epub.get();
+    }
+    return NULL;
+}
+
+/*
+ * Batch mode: one json object per line for each book,
+ * or one length prefixed cbor record, with the file
+ * name and the same fields as bookdump's info.json
+ */
+static int batch(int format, int count, char** files) {
+    std::unique_ptr<MetaWriter> meta(MetaWriter::create(format, 1));
+    MetaWriter & out = *meta;
+    std::unique_ptr<MobiBook> mobi;
+    std::unique_ptr<Epub> epub;
+    int res = 0;
+    for(int i = 0; i < count; ++i) {
+	Ebook * m = reopenBook(files[i], mobi, epub);
+	if(m==NULL) {
+	    cerr << "Unable to open ebook " << files[i] << std::endl;
+	    res = 1;
+	    continue;
+	}
+	out.beginObject();
+	out.add("file", files[i]);
+	std::unique_ptr<Dumper> d(m->getDumper(""));
+	d->info(out);
+	out.endObject().endRecord();
+    }
+    return res;
+}
+
+// copy the next cbor item to out (strings are passed on
+// without copies, except the keys); the reader limits the nesting
+static bool copyItem(CborReader & in, MetaWriter & out) {
+    const char * s;
+    size_t len;
+    long v;
+
+    switch(in.peek()) {
+	case CborReader::Int:
+	    if(!in.readInt(v)) return false;
+	    out.value(v);
+	    return true;
+	case CborReader::String:
+	    if(!in.readString(s, len)) return false;
+	    out.value(s, len);
+	    return true;
+	case CborReader::Array:
+	    if(!in.enter()) return false;
+	    out.beginArray();
+	    while(!in.atEnd())
+		if(!copyItem(in, out)) return false;
+	    out.endArray();
+	    return in.leave();
+	case CborReader::Map:
+	    if(!in.enter()) return false;
+	    out.beginObject();
+	    while(!in.atEnd()) {
+		if(!in.readString(s, len)) return false;
+		out.key(string(s, len));
+		if(!copyItem(in, out)) return false;
+	    }
+	    out.endObject();
+	    return in.leave();
+	default:
+	    return false;
+    }
+}
+
+/*
+ * Read back the cbor records of -c, as json lines
+ */
+static int readBack(const char * file) {
+    FILE * f = strcmp(file, "-") ? fopen(file, "rb") : stdin;
+    if(f == NULL) {
+	cerr << "Unable to open " << file << std::endl;
+	return 1;
+    }
+    string data;
+    char buf[65536];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+    if(f != stdin) fclose(f);
+
+    std::unique_ptr<MetaWriter> meta(MetaWriter::create(META_JSON, 1));
+    CborReader all(data.data(), data.size()), rec(NULL, 0);
+    while(all.nextRecord(rec)) {
+	// checked first, so that a bad record writes nothing
+	CborReader check = rec;
+	if(!check.skip() || !check.atEnd() || !copyItem(rec, *meta)) {
+	    cerr << "Invalid record in " << file << std::endl;
+	    return 1;
+	}
+	meta->endRecord();
+    }
+    if(!all.atEnd()) {
+	cerr << "Truncated data in " << file << std::endl;
+	return 1;
+    }
+    return 0;
+}
+
 /*
  * 
  */
 int main(int argc, char** argv) {
+    if(argc > 2 && !strcmp(argv[1], "-j"))
+	return batch(META_JSON, argc-2, argv+2);
+    if(argc > 2 && !strcmp(argv[1], "-c"))
+	return batch(META_CBOR, argc-2, argv+2);
+    if(argc == 3 && !strcmp(argv[1], "-r"))
+	return readBack(argv[2]);
+
     if(argc == 2) {
-	Ebook * m = NULL;
 	string file = argv[1];
-
-	if(file.find(".mobi",file.length()-5, 5) != string::npos)
-	    m = (Ebook*) MobiBook::createFromFile(argv[1]);
-	else if(file.find(".epub",file.length()-5, 5) != string::npos)
-	    m = (Ebook*) Epub::createFromFile(argv[1]);
+	Ebook * m = openBook(file);
 
 	if(m==NULL) {
 	    cerr << "Unable to open ebook " << file << std::endl;
@@ -53,7 +191,10 @@ int main(int argc, char** argv) {
     }
 
     //no args
-    cerr << "Usage: " << argv[0] << " <mobifile>" << std::endl;
+    cerr << "Usage: " << argv[0] << " <ebook>" << std::endl;
+    cerr << "       " << argv[0] << " -j <ebook>..." << std::endl;
+    cerr << "       " << argv[0] << " -c <ebook>..." << std::endl;
+    cerr << "       " << argv[0] << " -r <records.cbor|->" << std::endl;
     return 1;
 }
 